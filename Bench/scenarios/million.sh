@@ -0,0 +1,55 @@
+#!/bin/sh
+# One million idle chat connections on a single host over loopback.
+#
+#   million.sh <path to Server> <path to chatbench>
+#
+# Both processes hold one descriptor per connection and the kernel two
+# sockets per pair, so the host needs roughly (as root):
+#
+#   sysctl -w fs.nr_open=1100000 fs.file-max=2500000
+#   sysctl -w net.core.somaxconn=65535 net.ipv4.tcp_max_syn_backlog=65535
+#   sysctl -w net.ipv4.ip_local_port_range="1024 65535"
+#   ulimit -Hn 1100000
+#
+# and about 8 GB of memory, most of it kernel socket state. One source
+# address runs out of ephemeral ports at ~64k connections to the same
+# port, so clients spread over SOURCES loopback addresses.
+set -e
+
+SERVER=${1:?usage: million.sh <Server> <chatbench>}
+BENCH=${2:?usage: million.sh <Server> <chatbench>}
+PORT=${PORT:-7000}
+METRICS_PORT=${METRICS_PORT:-7001}
+CLIENTS=${CLIENTS:-1000000}
+SOURCES=${SOURCES:-32}
+SHARDS=${SHARDS:-$(nproc)}
+THREADS=${THREADS:-4}
+JOIN_RATE=${JOIN_RATE:-50000}
+HOLD=${HOLD:-30}
+
+for setting in fs.nr_open net.core.somaxconn net.ipv4.ip_local_port_range; do
+    echo "$setting = $(sysctl -n $setting)"
+done
+echo "open files allowed: $(ulimit -Hn)"
+
+# join notices in a full lobby cost a write per member each, announcing
+# even the first thousand joins starves the name timeout during the ramp
+"$SERVER" -p "$PORT" -s "$SHARDS" --metrics-port="$METRICS_PORT" --log-level=error \
+    --max-connections="$CLIENTS" --listen-backlog=65535 --accept-batch=1024 \
+    --max-pending=65536 --presence-limit=100 --idle-timeout=3600000 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT
+sleep 1
+
+# no chat, the point is holding the connections
+"$BENCH" -p "$PORT" -c "$CLIENTS" -t "$THREADS" --join-rate="$JOIN_RATE" \
+    --rate=0 --source-ips="$SOURCES" -d "$HOLD" &
+BENCH_PID=$!
+
+sleep $((CLIENTS / JOIN_RATE + 5))
+echo "server while holding:"
+curl -s "http://127.0.0.1:$METRICS_PORT/metrics" \
+    | grep -E '^chat_(sessions|pending_sessions|connections_(accepted|rejected)_total) '
+grep -E 'VmRSS|VmHWM' "/proc/$SERVER_PID/status"
+
+wait $BENCH_PID
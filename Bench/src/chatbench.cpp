@@ -0,0 +1,607 @@
+#include "msg.h"
+#include "framer.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "optionargs.h"
+
+#include <uv.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <random>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <csignal>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+// Load generator: simulated chat clients spread over a few libuv loops.
+// Every message starts with its send time (uv_hrtime, which is the same
+// clock in every process on the host), receivers turn it into fan-out
+// latency.
+
+enum class SizeDistribution
+{
+    Fixed,
+    Uniform,
+    Exponential
+};
+
+struct BenchConfig
+{
+    BenchConfig()
+        : host("127.0.0.1")
+        , port(0)
+        , clients(1000)
+        , threads(4)
+        , join_rate(1000)
+        , message_rate(1)
+        , min_size(32)
+        , max_size(256)
+        , distribution(SizeDistribution::Uniform)
+        , rooms(1)
+        , duration(10)
+        , binary(false)
+        , source_ips(0)
+    {
+    }
+
+    std::string host;
+    int port;
+    int clients;
+    int threads;
+    // connections per second over all threads
+    double join_rate;
+    // messages per second per client
+    double message_rate;
+    size_t min_size;
+    size_t max_size;
+    SizeDistribution distribution;
+    // client i talks in room i % rooms, room 0 is the lobby
+    int rooms;
+    double duration;
+    bool binary;
+    // connections come from 127.0.0.1, .2, ... up to this many addresses,
+    // each good for one ephemeral port range; 0 lets the kernel pick
+    int source_ips;
+};
+
+// send stamp: '@' and 16 hex digits
+static const size_t STAMP_SIZE = 17;
+static const int TICK_MS = 5;
+static const size_t READ_BUFFER_SIZE = 64 * 1024;
+// stop feeding a connection the server doesn't drain
+static const size_t MAX_WRITE_QUEUE = 256 * 1024;
+
+static std::atomic<bool> measuring(false);
+
+class BenchWorker
+{
+public:
+    BenchWorker(const BenchConfig& config, int id, int client_count);
+
+    void Run();
+    void Stop();
+
+    std::atomic<uint64_t> connected;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> delivered;
+    std::atomic<uint64_t> throttled;
+    LatencyHistogram latency;
+
+protected:
+    struct Client
+    {
+        uv_tcp_t handle;
+        uv_connect_t connect;
+        FrameSplitter reader;
+        std::string name;
+        int room;
+        int source;
+        bool ready;
+    };
+
+    void Connect(Client* client);
+    void OnConnect(Client* client, int status);
+    void OnRead(Client* client, ssize_t nread);
+    void OnFrame(FrameView frame);
+    void OnTick();
+    void SendText(Client* client, const char* text, size_t len);
+    void SendChat(Client* client);
+    size_t NextSize();
+
+    const BenchConfig& config;
+    int id;
+    uv_loop_t loop;
+    uv_timer_t tick;
+    sockaddr_in address;
+    std::atomic<bool> stopping;
+
+    std::vector<std::unique_ptr<Client>> clients;
+    size_t opened;
+    std::vector<Client*> ready;
+    size_t cursor;
+    double join_credit;
+    double send_credit;
+    uint64_t last_tick;
+
+    MsgAllocator messages;
+    WritePool writes;
+    std::mt19937 rng;
+    std::vector<char> text;
+    char read_buffer[READ_BUFFER_SIZE];
+};
+
+BenchWorker::BenchWorker(const BenchConfig& config, int id, int client_count)
+    : connected(0)
+    , failed(0)
+    , sent(0)
+    , delivered(0)
+    , throttled(0)
+    , config(config)
+    , id(id)
+    , stopping(false)
+    , opened(0)
+    , cursor(0)
+    , join_credit(0)
+    , send_credit(0)
+    , last_tick(0)
+    , rng(id + 1)
+{
+    for (int i = 0; i < client_count; i++)
+    {
+        clients.emplace_back(new Client());
+        Client* client = clients.back().get();
+        client->name = "bench" + std::to_string(id) + "_" + std::to_string(i);
+        // spread rooms over the whole population, not per thread
+        client->room = (i * config.threads + id) % config.rooms;
+        client->source = config.source_ips != 0 ? (i * config.threads + id) % config.source_ips : 0;
+        client->ready = false;
+        if (config.binary)
+        {
+            client->reader.SetLengthPrefixed(MeasureFrame);
+        }
+    }
+}
+
+void BenchWorker::Run()
+{
+    uv_loop_init(&loop);
+    loop.data = this;
+    uv_ip4_addr(config.host.c_str(), config.port, &address);
+
+    uv_timer_init(&loop, &tick);
+    uv_timer_start(&tick,
+                   [] (uv_timer_t* handle)
+                   {
+                       static_cast<BenchWorker*>(handle->loop->data)->OnTick();
+                   },
+                   TICK_MS,
+                   TICK_MS);
+    last_tick = uv_hrtime();
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+}
+
+void BenchWorker::Stop()
+{
+    stopping = true;
+}
+
+void BenchWorker::Connect(Client* client)
+{
+    uv_tcp_init_ex(&loop, &client->handle, AF_INET);
+    client->handle.data = client;
+    if (config.source_ips != 0)
+    {
+        uv_os_fd_t fd;
+        uv_fileno((uv_handle_t*)&client->handle, &fd);
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        // the port is picked at connect time, unique per destination only
+        int on = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+        sockaddr_in source;
+        uv_ip4_addr("127.0.0.1", 0, &source);
+        source.sin_addr.s_addr = htonl(ntohl(source.sin_addr.s_addr) + client->source);
+        if (uv_tcp_bind(&client->handle, (const sockaddr*)&source, 0) != 0)
+        {
+            failed++;
+            uv_close((uv_handle_t*)&client->handle, nullptr);
+            return;
+        }
+    }
+
+    client->connect.data = client;
+    uv_tcp_connect(&client->connect,
+                   &client->handle,
+                   (const sockaddr*)&address,
+                   [] (uv_connect_t* req, int status)
+                   {
+                       static_cast<BenchWorker*>(req->handle->loop->data)->OnConnect(static_cast<Client*>(req->data), status);
+                   });
+}
+
+void BenchWorker::OnConnect(Client* client, int status)
+{
+    if (status != 0)
+    {
+        failed++;
+        uv_close((uv_handle_t*)&client->handle, nullptr);
+        return;
+    }
+
+    uv_read_start((uv_stream_t*)&client->handle,
+                  [] (uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+                  {
+                      BenchWorker* worker = static_cast<BenchWorker*>(handle->loop->data);
+                      *buf = uv_buf_init(worker->read_buffer, sizeof(worker->read_buffer));
+                  },
+                  [] (uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+                  {
+                      BenchWorker* worker = static_cast<BenchWorker*>(stream->loop->data);
+                      worker->OnRead(static_cast<Client*>(stream->data), nread);
+                  });
+
+    if (config.binary)
+    {
+        Msg* hello = EncodeHello(messages, 0, client->name);
+        WriteReq* req = writes.Acquire(hello);
+        hello->Release();
+        uv_write(&req->request, (uv_stream_t*)&client->handle, req->payload->GetBuf(), 1,
+                 [] (uv_write_t* req, int status)
+                 {
+                     static_cast<BenchWorker*>(req->handle->loop->data)->writes.Release(WritePool::FromRequest(req));
+                 });
+    }
+    else
+    {
+        SendText(client, client->name.data(), client->name.size());
+    }
+
+    if (client->room != 0)
+    {
+        std::string join = "/join bench" + std::to_string(client->room);
+        SendText(client, join.data(), join.size());
+    }
+
+    client->ready = true;
+    ready.push_back(client);
+    connected++;
+}
+
+void BenchWorker::OnRead(Client* client, ssize_t nread)
+{
+    if (nread < 0)
+    {
+        if (client->ready)
+        {
+            client->ready = false;
+            ready.erase(std::find(ready.begin(), ready.end(), client));
+            connected--;
+            failed++;
+        }
+        uv_close((uv_handle_t*)&client->handle, nullptr);
+        return;
+    }
+
+    client->reader.Feed(read_buffer, nread, [this] (FrameView frame)
+                        {
+                            OnFrame(frame);
+                            return true;
+                        });
+}
+
+void BenchWorker::OnFrame(FrameView frame)
+{
+    FrameView text = frame;
+    if (config.binary)
+    {
+        FrameHeader header;
+        if (!DecodeFrame(frame, &header, &text) || header.type != FrameType::Chat)
+        {
+            return;
+        }
+    }
+
+    // "[#room ]name:@<stamp> ..."
+    const char* end = text.data + text.size;
+    const char* stamp = std::search(text.data, end, ":@", ":@" + 2);
+    if (stamp == end || (size_t)(end - stamp) < STAMP_SIZE + 1 || !measuring)
+    {
+        return;
+    }
+
+    char digits[17];
+    memcpy(digits, stamp + 2, 16);
+    digits[16] = 0;
+    uint64_t sent_at = strtoull(digits, nullptr, 16);
+    uint64_t now = uv_hrtime();
+    if (sent_at != 0 && sent_at <= now)
+    {
+        latency.Record((now - sent_at) / 1000);
+        delivered.store(delivered.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+void BenchWorker::SendText(Client* client, const char* data, size_t len)
+{
+    Msg* message;
+    if (config.binary)
+    {
+        FrameHeader header = { FrameType::Chat, 0, 0, 0 };
+        message = EncodeFrame(messages, header, data, len);
+    }
+    else
+    {
+        message = messages.Create(data, len);
+    }
+
+    WriteReq* req = writes.Acquire(message);
+    message->Release();
+    uv_write(&req->request, (uv_stream_t*)&client->handle, req->payload->GetBuf(), 1,
+             [] (uv_write_t* req, int status)
+             {
+                 static_cast<BenchWorker*>(req->handle->loop->data)->writes.Release(WritePool::FromRequest(req));
+             });
+}
+
+size_t BenchWorker::NextSize()
+{
+    size_t size = config.min_size;
+    if (config.distribution == SizeDistribution::Uniform)
+    {
+        size = std::uniform_int_distribution<size_t>(config.min_size, config.max_size)(rng);
+    }
+    else if (config.distribution == SizeDistribution::Exponential)
+    {
+        // mostly small messages with the odd paste
+        double mean = std::max<double>(1, (config.max_size - config.min_size) / 8.0);
+        size = config.min_size + (size_t)std::exponential_distribution<double>(1.0 / mean)(rng);
+        size = std::min(size, config.max_size);
+    }
+    return std::max(size, STAMP_SIZE);
+}
+
+void BenchWorker::SendChat(Client* client)
+{
+    if (uv_stream_get_write_queue_size((uv_stream_t*)&client->handle) > MAX_WRITE_QUEUE)
+    {
+        throttled++;
+        return;
+    }
+
+    size_t size = NextSize();
+    text.resize(size);
+    snprintf(text.data(), STAMP_SIZE + 1, "@%016" PRIx64, uv_hrtime());
+    memset(text.data() + STAMP_SIZE, 'a' + sent % 26, size - STAMP_SIZE);
+    SendText(client, text.data(), size);
+    if (measuring)
+    {
+        sent.store(sent.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+void BenchWorker::OnTick()
+{
+    if (stopping)
+    {
+        uv_stop(&loop);
+        return;
+    }
+
+    uint64_t now = uv_hrtime();
+    double elapsed = (now - last_tick) / 1e9;
+    last_tick = now;
+
+    double join_rate = config.join_rate / config.threads;
+    join_credit = std::min(join_credit + elapsed * join_rate, join_rate);
+    while (join_credit >= 1 && opened < clients.size())
+    {
+        Connect(clients[opened++].get());
+        join_credit -= 1;
+    }
+
+    if (ready.empty())
+    {
+        return;
+    }
+
+    // at most one second of catch-up after a stall
+    double send_rate = config.message_rate * ready.size();
+    send_credit = std::min(send_credit + elapsed * send_rate, send_rate);
+    while (send_credit >= 1)
+    {
+        cursor = (cursor + 1) % ready.size();
+        SendChat(ready[cursor]);
+        send_credit -= 1;
+    }
+}
+
+enum optionIndex { UNKNOWN, HELP, HOST, PORT, CLIENTS, THREADS, JOIN_RATE, RATE,
+                   MIN_SIZE, MAX_SIZE, SIZE_DIST, ROOMS, DURATION, BINARY, SOURCE_IPS };
+const option::Descriptor usage[] =
+{
+    {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: chatbench -p PORT [options]" },
+    {HELP, 0, "", "help", Arg::None, "--help \t Print usage and exit." },
+    {HOST, 0, "a", "address", Arg::Required, "-a <host>, \t --address=<host> \t(default 127.0.0.1)"},
+    {PORT, 0, "p", "port", Arg::Numeric, "-p <port>, \t --port=<port>"},
+    {CLIENTS, 0, "c", "clients", Arg::Numeric, "-c <n>, \t --clients=<n> \t simulated clients (default 1000)"},
+    {THREADS, 0, "t", "threads", Arg::Numeric, "-t <n>, \t --threads=<n> \t event loops (default 4)"},
+    {JOIN_RATE, 0, "", "join-rate", Arg::Numeric, "--join-rate=<n> \t connections per second (default 1000)"},
+    {RATE, 0, "", "rate", Arg::Required, "--rate=<n> \t messages per second per client (default 1)"},
+    {MIN_SIZE, 0, "", "min-size", Arg::Numeric, "--min-size=<bytes> \t (default 32)"},
+    {MAX_SIZE, 0, "", "max-size", Arg::Numeric, "--max-size=<bytes> \t (default 256)"},
+    {SIZE_DIST, 0, "", "size-dist", Arg::Required, "--size-dist=<d> \t fixed (min-size), uniform (default) or exp"},
+    {ROOMS, 0, "", "rooms", Arg::Numeric, "--rooms=<n> \t rooms the clients are spread over (default 1, the lobby)"},
+    {DURATION, 0, "d", "duration", Arg::Numeric, "-d <seconds>, \t --duration=<seconds> \t measurement time (default 10)"},
+    {BINARY, 0, "b", "binary", Arg::None, "-b, \t --binary \t speak protocol v2"},
+    {SOURCE_IPS, 0, "", "source-ips", Arg::Numeric, "--source-ips=<n> \t connect from 127.0.0.1 up to 127.0.0.<n>, past one address' ephemeral ports"},
+    { 0, 0, 0, 0, 0, 0 },
+};
+
+int main(int argc, char* argv[])
+{
+    if (argc > 0)
+    {
+        argc--;
+        argv++;
+    }
+
+    option::Stats stats(usage, argc, argv);
+    option::Option options[stats.options_max];
+    option::Option buffer[stats.buffer_max];
+    option::Parser parse(usage, argc, argv, options, buffer);
+    if (parse.error() || options[HELP] || !options[PORT])
+    {
+        option::printUsage(fwrite, stderr, usage, 80);
+        return 1;
+    }
+
+    BenchConfig config;
+    config.port = std::stoi(options[PORT].arg);
+    if (options[HOST]) config.host = options[HOST].arg;
+    if (options[CLIENTS]) config.clients = std::stoi(options[CLIENTS].arg);
+    if (options[THREADS]) config.threads = std::max(1, std::stoi(options[THREADS].arg));
+    if (options[JOIN_RATE]) config.join_rate = std::stod(options[JOIN_RATE].arg);
+    if (options[RATE]) config.message_rate = std::stod(options[RATE].arg);
+    if (options[MIN_SIZE]) config.min_size = std::stoul(options[MIN_SIZE].arg);
+    if (options[MAX_SIZE]) config.max_size = std::stoul(options[MAX_SIZE].arg);
+    if (options[ROOMS]) config.rooms = std::max(1, std::stoi(options[ROOMS].arg));
+    if (options[DURATION]) config.duration = std::stod(options[DURATION].arg);
+    config.binary = options[BINARY] != nullptr;
+    if (options[SOURCE_IPS]) config.source_ips = std::max(0, std::min(254, std::stoi(options[SOURCE_IPS].arg)));
+    config.max_size = std::max(config.max_size, config.min_size);
+
+    if (options[SIZE_DIST])
+    {
+        std::string dist = options[SIZE_DIST].arg;
+        if (dist == "fixed")
+        {
+            config.distribution = SizeDistribution::Fixed;
+        }
+        else if (dist == "uniform")
+        {
+            config.distribution = SizeDistribution::Uniform;
+        }
+        else if (dist == "exp")
+        {
+            config.distribution = SizeDistribution::Exponential;
+        }
+        else
+        {
+            fprintf(stderr, "unknown size distribution %s\n", dist.c_str());
+            return 1;
+        }
+    }
+
+    // a server going away must not take the report with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // one descriptor per client
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)config.clients + 64)
+    {
+        fprintf(stderr, "warning: only %llu open files allowed\n", (unsigned long long)limit.rlim_cur);
+    }
+
+    std::vector<std::unique_ptr<BenchWorker>> workers;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.threads; i++)
+    {
+        int share = config.clients / config.threads + (i < config.clients % config.threads ? 1 : 0);
+        workers.emplace_back(new BenchWorker(config, i, share));
+    }
+    for (auto& worker : workers)
+    {
+        BenchWorker* w = worker.get();
+        threads.emplace_back([w] () { w->Run(); });
+    }
+
+    // ramp up, then measure a steady state
+    auto ramp_start = std::chrono::steady_clock::now();
+    auto join_deadline = ramp_start + std::chrono::milliseconds((int64_t)(1000 * config.clients / config.join_rate) + 5000);
+    auto next_report = ramp_start + std::chrono::seconds(1);
+    uint64_t connected = 0;
+    while (std::chrono::steady_clock::now() < join_deadline)
+    {
+        connected = 0;
+        uint64_t failed = 0;
+        for (auto& worker : workers)
+        {
+            connected += worker->connected;
+            failed += worker->failed;
+        }
+        if (connected + failed >= (uint64_t)config.clients)
+        {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= next_report)
+        {
+            // long ramps show their progress
+            next_report += std::chrono::seconds(1);
+            printf("ramp %5.0fs  connected %10" PRIu64 "  failed %" PRIu64 "\n",
+                   std::chrono::duration<double>(std::chrono::steady_clock::now() - ramp_start).count(),
+                   connected, failed);
+            fflush(stdout);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    double ramp = std::chrono::duration<double>(std::chrono::steady_clock::now() - ramp_start).count();
+
+    printf("clients %d, connected %" PRIu64 " in %.1fs, measuring for %.1fs\n",
+           config.clients, connected, ramp, config.duration);
+    measuring = true;
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds((int64_t)(config.duration * 1000)));
+    measuring = false;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (auto& worker : workers)
+    {
+        worker->Stop();
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t throttled = 0;
+    uint64_t failed = 0;
+    std::unique_ptr<LatencyHistogram> latency(new LatencyHistogram());
+    for (auto& worker : workers)
+    {
+        sent += worker->sent;
+        delivered += worker->delivered;
+        throttled += worker->throttled;
+        failed += worker->failed;
+        latency->Merge(worker->latency);
+    }
+
+    printf("sent      %10" PRIu64 " msgs  %12.1f msg/s  (%" PRIu64 " throttled)\n", sent, sent / elapsed, throttled);
+    printf("delivered %10" PRIu64 " msgs  %12.1f msg/s  (fan-out %.1f)\n",
+           delivered, delivered / elapsed, sent != 0 ? (double)delivered / sent : 0.0);
+    printf("failed connections %" PRIu64 "\n", failed);
+    printf("latency us: p50 %" PRIu64 "  p90 %" PRIu64 "  p99 %" PRIu64 "  p99.9 %" PRIu64 "  max %" PRIu64 "\n",
+           latency->ValueAtQuantile(0.5),
+           latency->ValueAtQuantile(0.9),
+           latency->ValueAtQuantile(0.99),
+           latency->ValueAtQuantile(0.999),
+           latency->ValueAtQuantile(1.0));
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "framer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Measures frame splitting throughput in GB/s over a synthetic stream of
+// NUL-delimited frames, fed in read-sized chunks like the server sees them.
+
+static const size_t STREAM_SIZE = 64 * 1024 * 1024;
+static const size_t READ_SIZE = 64 * 1024;
+static const int ROUNDS = 5;
+
+static std::vector<char> MakeStream(size_t average_frame)
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> length(average_frame / 2, average_frame + average_frame / 2);
+    std::vector<char> stream(STREAM_SIZE);
+    size_t pos = 0;
+    while (pos < stream.size())
+    {
+        size_t len = std::min(length(rng), stream.size() - pos - 1);
+        memset(&stream[pos], 'a' + (pos % 26), len);
+        pos += len;
+        stream[pos++] = 0;
+        if (stream.size() - pos < 2)
+        {
+            break;
+        }
+    }
+    return stream;
+}
+
+static double Measure(const std::vector<char>& stream, find_delimiter_fn find, size_t* frames_out)
+{
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        size_t frames = 0;
+        size_t partial = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t offset = 0; offset < stream.size(); offset += READ_SIZE)
+        {
+            const char* pos = stream.data() + offset;
+            const char* end = stream.data() + std::min(offset + READ_SIZE, stream.size());
+            while (pos < end)
+            {
+                const char* found = find(pos, end, 0);
+                if (found == nullptr)
+                {
+                    partial += end - pos;
+                    break;
+                }
+                frames++;
+                partial = 0;
+                pos = found + 1;
+            }
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double gbps = stream.size() / elapsed / 1e9;
+        best = std::max(best, gbps);
+        *frames_out = frames + (partial > 0 ? 1 : 0);
+    }
+    return best;
+}
+
+static double MeasureSplitter(const std::vector<char>& stream, size_t* frames_out)
+{
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        FrameSplitter splitter;
+        size_t frames = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t offset = 0; offset < stream.size(); offset += READ_SIZE)
+        {
+            size_t len = std::min(READ_SIZE, stream.size() - offset);
+            splitter.Feed(stream.data() + offset, len, [&frames] (FrameView frame)
+                          {
+                              frames++;
+                              return true;
+                          });
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::max(best, stream.size() / elapsed / 1e9);
+        *frames_out = frames;
+    }
+    return best;
+}
+
+int main()
+{
+    const size_t frame_sizes[] = { 16, 64, 256, 1024, 16384 };
+
+    printf("%-10s %-12s %10s %12s\n", "frame", "scanner", "GB/s", "frames");
+    for (size_t frame_size : frame_sizes)
+    {
+        std::vector<char> stream = MakeStream(frame_size);
+
+        struct Candidate
+        {
+            const char* name;
+            find_delimiter_fn find;
+        };
+        std::vector<Candidate> candidates = { {"scalar", FindDelimiterScalar},
+                                              {"memchr", FindDelimiterMemchr} };
+#ifdef FRAMER_HAS_X86_SIMD
+        candidates.push_back({"sse2", FindDelimiterSSE2});
+        if (CpuHasAVX2())
+        {
+            candidates.push_back({"avx2", FindDelimiterAVX2});
+        }
+#endif
+
+        for (const Candidate& candidate : candidates)
+        {
+            size_t frames = 0;
+            double gbps = Measure(stream, candidate.find, &frames);
+            printf("%-10zu %-12s %10.2f %12zu\n", frame_size, candidate.name, gbps, frames);
+        }
+
+        size_t frames = 0;
+        double gbps = MeasureSplitter(stream, &frames);
+        printf("%-10zu %-12s %10.2f %12zu\n", frame_size, "splitter", gbps, frames);
+    }
+    return 0;
+}
@@ -0,0 +1,412 @@
+#include "msg.h"
+#include "framer.h"
+#include "protocol.h"
+#include "session.h"
+#include "nameregistry.h"
+#include "rooms.h"
+#include "outbound.h"
+#include "history.h"
+
+#include <benchmark/benchmark.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Microbenchmarks of the server's building blocks. Output is JSON unless
+// another --benchmark_format is given; two runs compare with
+// tools/compare.py from the Google Benchmark sources.
+
+static const size_t STREAM_SIZE = 4 * 1024 * 1024;
+static const size_t READ_SIZE = 64 * 1024;
+
+// legacy frames of about frame_size bytes, NUL-terminated
+static std::vector<char> MakeDelimitedStream(size_t frame_size)
+{
+    std::vector<char> stream;
+    stream.reserve(STREAM_SIZE + frame_size + 1);
+    while (stream.size() < STREAM_SIZE)
+    {
+        stream.insert(stream.end(), frame_size, 'a' + stream.size() % 26);
+        stream.push_back(0);
+    }
+    return stream;
+}
+
+static std::vector<char> MakeFramedStream(size_t frame_size)
+{
+    MsgAllocator allocator;
+    std::string payload(frame_size, 'x');
+    FrameHeader header = { FrameType::Chat, 0, 0, 0 };
+    std::vector<char> stream;
+    stream.reserve(STREAM_SIZE + frame_size + MAX_VARINT_SIZE + 1);
+    while (stream.size() < STREAM_SIZE)
+    {
+        Msg* frame = EncodeFrame(allocator, header, payload.data(), payload.size());
+        stream.insert(stream.end(), frame->Data(), frame->Data() + frame->Size());
+        frame->Release();
+    }
+    return stream;
+}
+
+static void SplitStream(benchmark::State& state, const std::vector<char>& stream, FrameSplitter& splitter)
+{
+    size_t frames = 0;
+    for (auto _ : state)
+    {
+        for (size_t offset = 0; offset < stream.size(); offset += READ_SIZE)
+        {
+            size_t len = std::min(READ_SIZE, stream.size() - offset);
+            splitter.Feed(stream.data() + offset, len, [&frames] (FrameView frame)
+                          {
+                              benchmark::DoNotOptimize(frame.data);
+                              frames++;
+                              return true;
+                          });
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * stream.size());
+    state.SetItemsProcessed(frames);
+}
+
+// the per-read frame loop of OnMsgRecv
+static void BM_SplitDelimited(benchmark::State& state)
+{
+    std::vector<char> stream = MakeDelimitedStream(state.range(0));
+    FrameSplitter splitter;
+    SplitStream(state, stream, splitter);
+}
+BENCHMARK(BM_SplitDelimited)->Arg(16)->Arg(256)->Arg(4096);
+
+static void BM_SplitLengthPrefixed(benchmark::State& state)
+{
+    std::vector<char> stream = MakeFramedStream(state.range(0));
+    FrameSplitter splitter;
+    splitter.SetLengthPrefixed(MeasureFrame);
+    SplitStream(state, stream, splitter);
+}
+BENCHMARK(BM_SplitLengthPrefixed)->Arg(16)->Arg(256)->Arg(4096);
+
+static void BM_MsgCreate(benchmark::State& state)
+{
+    MsgAllocator allocator;
+    std::string text(state.range(0), 'm');
+    for (auto _ : state)
+    {
+        Msg* msg = allocator.Create(text);
+        benchmark::DoNotOptimize(msg->Data());
+        msg->Release();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MsgCreate)->Arg(32)->Arg(1024)->Arg(16 * 1024)->Arg(256 * 1024);
+
+static void BM_EncodeFrame(benchmark::State& state)
+{
+    MsgAllocator allocator;
+    std::string text(state.range(0), 'm');
+    FrameHeader header = { FrameType::Chat, FRAME_FLAG_SENDER | FRAME_FLAG_SEQUENCE, 12345, 678910 };
+    for (auto _ : state)
+    {
+        Msg* frame = EncodeFrame(allocator, header, text.data(), text.size());
+        benchmark::DoNotOptimize(frame->Data());
+        frame->Release();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeFrame)->Arg(32)->Arg(1024);
+
+static void BM_WritePool(benchmark::State& state)
+{
+    MsgAllocator allocator;
+    WritePool writes;
+    Msg* msg = allocator.Create("payload");
+    std::vector<WriteReq*> batch(state.range(0));
+    for (auto _ : state)
+    {
+        for (WriteReq*& req : batch)
+        {
+            req = writes.Acquire(msg);
+        }
+        for (WriteReq* req : batch)
+        {
+            writes.Release(req);
+        }
+    }
+    msg->Release();
+    state.SetItemsProcessed(state.iterations() * batch.size());
+}
+BENCHMARK(BM_WritePool)->Arg(1)->Arg(64);
+
+static void BM_SessionFind(benchmark::State& state)
+{
+    SessionTable sessions;
+    std::vector<SessionRef> refs;
+    for (int64_t i = 0; i < state.range(0); i++)
+    {
+        refs.push_back(sessions.MakeRef(sessions.Acquire()));
+    }
+    std::shuffle(refs.begin(), refs.end(), std::mt19937(7));
+
+    size_t next = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(sessions.Find(refs[next]));
+        next = next + 1 == refs.size() ? 0 : next + 1;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SessionFind)->Arg(10)->Arg(1000)->Arg(100000);
+
+static std::vector<std::string> MakeNames(size_t count, const char* prefix)
+{
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; i++)
+    {
+        names.push_back(prefix + std::to_string(i * 2654435761u % 1000003));
+    }
+    return names;
+}
+
+// the duplicate check on handshake: a taken name, compared case-folded
+static void BM_NameDuplicate(benchmark::State& state)
+{
+    NameRegistry registry;
+    std::vector<std::string> names = MakeNames(state.range(0), "user");
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        registry.Insert(names[i], NameOwner{0, SessionRef{(uint32_t)i, 0}});
+    }
+    for (std::string& name : names)
+    {
+        name[0] = 'U';
+    }
+
+    size_t next = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(registry.Insert(names[next], NameOwner{0, SessionRef{0, 0}}));
+        next = next + 1 == names.size() ? 0 : next + 1;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NameDuplicate)->Arg(10)->Arg(1000)->Arg(100000);
+
+// a free name: inserted, then removed again as its session leaves
+static void BM_NameInsertRemove(benchmark::State& state)
+{
+    NameRegistry registry;
+    std::vector<std::string> names = MakeNames(state.range(0), "user");
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        registry.Insert(names[i], NameOwner{0, SessionRef{(uint32_t)i, 0}});
+    }
+    std::vector<std::string> fresh = MakeNames(1024, "guest");
+
+    size_t next = 0;
+    for (auto _ : state)
+    {
+        registry.Insert(fresh[next], NameOwner{0, SessionRef{0, 0}});
+        registry.Remove(fresh[next]);
+        next = (next + 1) % fresh.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NameInsertRemove)->Arg(10)->Arg(1000)->Arg(100000);
+
+// BroadcastLocal's fan-out, encodings and write contexts included, over
+// sessions whose writes are only collected; the collected writes then
+// complete like OnMsgSent would release them. QueueWrite's limits and
+// uv_write are not part of it. Every fourth session speaks v2.
+static void BM_Broadcast(benchmark::State& state)
+{
+    MsgAllocator allocator;
+    WritePool writes;
+    SessionTable sessions;
+    RoomTable rooms;
+    for (int64_t i = 0; i < state.range(0); i++)
+    {
+        ChatSession* session = sessions.Acquire();
+        session->protocol = i % 4 == 3 ? WireProtocol::V2 : WireProtocol::Legacy;
+        rooms.Join(LOBBY_ROOM, session);
+    }
+
+    std::string text = "someone:" + std::string(64, 't');
+    std::vector<WriteReq*> kernel_queue;
+    kernel_queue.reserve(state.range(0));
+    uint64_t sequence = 0;
+    for (auto _ : state)
+    {
+        Outbound message(&allocator, FrameType::Chat, 1, ++sequence);
+        message.SetText(text.data(), text.size());
+        FanOut(message, rooms.Members(LOBBY_ROOM), [&writes, &kernel_queue] (ChatSession* session, Msg* payload)
+                                                   {
+                                                       WriteReq* req = writes.Acquire(payload);
+                                                       session->inflight_bytes += req->size;
+                                                       kernel_queue.push_back(req);
+                                                   });
+
+        for (WriteReq* req : kernel_queue)
+        {
+            writes.Release(req);
+        }
+        kernel_queue.clear();
+        for (ChatSession* session : rooms.Members(LOBBY_ROOM))
+        {
+            session->inflight_bytes = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Broadcast)->Arg(10)->Arg(1000)->Arg(100000);
+
+// A joiner's replay after a full ring of broadcasts, recorded the way
+// BroadcastLocal does: after the fan-out encoded every member's format.
+// The replay has to hand out the broadcasts' own payloads, a fresh Msg in
+// there means history went back to encoding per message, or to
+// deflating it again for every deflate joiner.
+static void BM_HistoryReplay(benchmark::State& state)
+{
+    static const size_t RING_SIZE = 32;
+    static const struct { WireProtocol protocol; uint64_t capabilities; } formats[] = {
+        { WireProtocol::Legacy, 0 },
+        { WireProtocol::V2, 0 },
+        // past COMPRESS_MIN_BYTES this is the deflated frame
+        { WireProtocol::V2, CAP_DEFLATE },
+    };
+    static const int FORMATS = sizeof(formats) / sizeof(formats[0]);
+
+    MsgAllocator allocator;
+    HistoryRing history;
+    history.SetCapacity(RING_SIZE);
+    std::vector<Msg*> sent[FORMATS];
+    std::string text = "someone:" + std::string(state.range(0), 't');
+    for (size_t i = 0; i < RING_SIZE; i++)
+    {
+        Outbound message(&allocator, FrameType::Chat, 1, i + 1);
+        message.SetText(text.data(), text.size());
+        for (int f = 0; f < FORMATS; f++)
+        {
+            Msg* payload = message.Encode(formats[f].protocol, formats[f].capabilities);
+            payload->AddRef();
+            sent[f].push_back(payload);
+        }
+        history.Record(message);
+    }
+
+    std::vector<Msg*> payloads;
+    for (int f = 0; f < FORMATS; f++)
+    {
+        payloads.clear();
+        history.Collect(formats[f].protocol, formats[f].capabilities, &payloads);
+        if (payloads != sent[f])
+        {
+            state.SkipWithError("replay built its own payloads instead of sharing the broadcast's");
+        }
+    }
+
+    int joiner = 0;
+    for (auto _ : state)
+    {
+        payloads.clear();
+        history.Collect(formats[joiner].protocol, formats[joiner].capabilities, &payloads);
+        benchmark::DoNotOptimize(payloads.data());
+        joiner = (joiner + 1) % FORMATS;
+    }
+    state.SetItemsProcessed(state.iterations() * RING_SIZE);
+
+    history.Clear();
+    for (std::vector<Msg*>& payloads_sent : sent)
+    {
+        for (Msg* payload : payloads_sent)
+        {
+            payload->Release();
+        }
+    }
+}
+BENCHMARK(BM_HistoryReplay)->Arg(64)->Arg(4096);
+
+static size_t ResidentBytes()
+{
+    long total = 0;
+    long resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr)
+    {
+        if (fscanf(statm, "%ld %ld", &total, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+// What idle connections really cost: sessions set up the way a server
+// started with --max-connections holds them, named, registered and
+// seated in the lobby, measured as resident memory per session. The
+// static_asserts in session.cpp only guard the layout; this is the
+// check on IDLE_SESSION_BUDGET, name registry included.
+static void BM_IdleSessionMemory(benchmark::State& state)
+{
+    size_t count = state.range(0);
+    std::vector<std::string> names = MakeNames(count, "user");
+    size_t bytes_per_session = 0;
+    for (auto _ : state)
+    {
+        size_t before = ResidentBytes();
+        {
+            SessionTable sessions;
+            RoomTable rooms;
+            NameRegistry registry;
+            sessions.Reserve(count);
+            rooms.ReserveMembers(LOBBY_ROOM, count);
+            registry.Reserve(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                ChatSession* session = sessions.Acquire();
+                session->SetName(FrameView{names[i].data(), names[i].size()});
+                registry.Insert(session->GetName(), NameOwner{0, sessions.MakeRef(session)});
+                session->Activate();
+                rooms.Join(LOBBY_ROOM, session);
+            }
+            bytes_per_session = (ResidentBytes() - before) / count;
+        }
+    }
+    state.counters["bytes_per_session"] = bytes_per_session;
+    if (bytes_per_session > IDLE_SESSION_BUDGET)
+    {
+        state.SkipWithError("an idle session outgrew its memory budget");
+    }
+}
+BENCHMARK(BM_IdleSessionMemory)->Arg(100000)->Iterations(1);
+
+int main(int argc, char** argv)
+{
+    std::vector<char*> args(argv, argv + argc);
+    bool has_format = false;
+    for (int i = 1; i < argc; i++)
+    {
+        has_format |= strncmp(argv[i], "--benchmark_format", strlen("--benchmark_format")) == 0;
+    }
+    char json_format[] = "--benchmark_format=json";
+    if (!has_format)
+    {
+        args.push_back(json_format);
+    }
+
+    int count = args.size();
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "msg.h"
+#include "framer.h"
+#include "protocol.h"
 
 #include <uv.h>
 #include <string>
@@ -12,7 +14,8 @@ class ChatSession
 {
 public:
     static ChatSession* GetInstance();
-    void Init(int port, const std::string& addr, const std::string& name);
+    void Init(int port, const std::string& addr, const std::string& name,
+              WireProtocol protocol = WireProtocol::Legacy);
     void ScheduleReconnect();
 
     void StdinRead(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
@@ -27,6 +30,9 @@ private:
     ChatSession();
     ~ChatSession();
     void Connect();
+    void DisplayFrame(FrameView frame);
+    Msg* EncodeChat(const std::string& text);
+
     uv_loop_t mainloop;
     uv_tcp_t socket;
     uv_connect_t connection;
@@ -38,10 +44,12 @@ private:
     bool sending_name;
     std::string name;
 
-    std::string next_message;
+    WireProtocol protocol;
+    FrameSplitter reader;
     uv_pipe_t user_input;
 
     std::vector<char> read_buffer;
-    MsgPool outgoing_queue;
+    WritePool outgoing_queue;
+    MsgAllocator messages;
     
 };
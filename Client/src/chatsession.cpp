@@ -1,4 +1,5 @@
 #include "chatsession.h"
+#include "compression.h"
 
 #include <iostream>
 #include <functional>
@@ -28,9 +29,9 @@ void ChatSession::StdinRead(uv_stream_t* stream, ssize_t nread, const uv_buf_t*
     else
     {
         std::string msg(buf->base, nread - 1); // do not take newline
-        std::shared_ptr<Msg> new_msg = std::make_shared<Msg>(Msg(msg));
-        outgoing_queue.messages.push(new_msg);
-        ChatSession::GetInstance()->SendMsg(outgoing_queue.messages.back().get());   
+        Msg* new_msg = EncodeChat(msg);
+        ChatSession::GetInstance()->SendMsg(new_msg);   
+        new_msg->Release();
     }
 }
 
@@ -44,12 +45,20 @@ void ChatSession::OnRead(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf
     }
     else if (nread > 0)
     {
-        display_line(buf->base);
-        next_message.append(buf->base);
+        bool well_formed = reader.Feed(buf->base, nread, [this] (FrameView frame)
+                                       {
+                                           DisplayFrame(frame);
+                                           return true;
+                                       });
+        if (!well_formed)
+        {
+            display_line("Malformed data from server");
+            uv_read_stop(stream);
+            uv_read_stop((uv_stream_t*)&user_input);
+        }
     }
     else if (nread == 0)
     {
-        next_message.clear();
     }
     else
     {
@@ -59,6 +68,52 @@ void ChatSession::OnRead(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf
     }
 }
 
+void ChatSession::DisplayFrame(FrameView frame)
+{
+    if (protocol == WireProtocol::Legacy)
+    {
+        display_line(frame.ToString());
+        return;
+    }
+
+    FrameHeader header;
+    FrameView payload;
+    if (!DecodeFrame(frame, &header, &payload))
+    {
+        display_line("Malformed frame");
+    }
+    else if (header.type == FrameType::Hello)
+    {
+        display_line("Joined using protocol v" + std::to_string(PROTOCOL_VERSION));
+    }
+    else
+    {
+        std::string text = payload.ToString();
+        if ((header.flags & FRAME_FLAG_COMPRESSED) != 0)
+        {
+            std::vector<char> inflated;
+            if (!Inflate(payload.data, payload.size, MAX_FRAME_PAYLOAD, &inflated))
+            {
+                display_line("Corrupt compressed frame");
+                return;
+            }
+            text.assign(inflated.data(), inflated.size());
+        }
+
+        display_line(header.type == FrameType::Error ? "Error: " + text : text);
+    }
+}
+
+Msg* ChatSession::EncodeChat(const std::string& text)
+{
+    if (protocol == WireProtocol::V2)
+    {
+        FrameHeader header = { FrameType::Chat, 0, 0, 0 };
+        return EncodeFrame(messages, header, text.data(), text.size());
+    }
+    return messages.Create(text);
+}
+
 ChatSession* ChatSession::GetInstance()
 {
     static ChatSession session;
@@ -67,8 +122,7 @@ ChatSession* ChatSession::GetInstance()
 
 void ChatSession::OnMsgSent(uv_write_t* req, int status)
 {
-    outgoing_queue.messages.pop();
-    outgoing_queue.requests.Release();
+    outgoing_queue.Release(WritePool::FromRequest(req));
 
     if (status == 0)
     {
@@ -97,9 +151,7 @@ void ChatSession::OnMsgSent(uv_write_t* req, int status)
 
 void ChatSession::SendMsg(Msg* message)
 {
-    // we know that send is scheduled right after input
-    // so no point to make multiple 'req'
-    uv_write(outgoing_queue.requests.GetNew(),
+    uv_write(&outgoing_queue.Acquire(message)->request,
              connection_handle,
              message->GetBuf(),
              1,
@@ -125,9 +177,10 @@ void ChatSession::OnConnect(uv_connect_t* connection, int status)
         connection_handle = connection->handle;
        
         // now send the name
-        std::shared_ptr<Msg> new_msg = std::make_shared<Msg>(Msg(name));
-        outgoing_queue.messages.push(new_msg);
-        ChatSession::GetInstance()->SendMsg(outgoing_queue.messages.back().get());
+        Msg* new_msg = protocol == WireProtocol::V2 ? EncodeHello(messages, CompressionAvailable() ? CAP_DEFLATE : 0, name)
+                                                    : messages.Create(name);
+        ChatSession::GetInstance()->SendMsg(new_msg);
+        new_msg->Release();
     }
     else
     {
@@ -172,8 +225,14 @@ void ChatSession::Connect()
     
 }
 
-void ChatSession::Init(int port, const std::string& addr, const std::string& name)
+void ChatSession::Init(int port, const std::string& addr, const std::string& name, WireProtocol protocol)
 {
+    this->protocol = protocol;
+    if (protocol == WireProtocol::V2)
+    {
+        reader.SetLengthPrefixed(MeasureFrame);
+    }
+
     uv_tcp_init(&mainloop, &socket);
     uv_ip4_addr(addr.c_str(), port, &dest);
     this->name = name;
@@ -192,6 +251,7 @@ ChatSession::ChatSession()
     : main_loop_running(false)
     , connection_handle(nullptr)
     , sending_name(true)
+    , protocol(WireProtocol::Legacy)
 {
     uv_loop_init(&mainloop);
     uv_timer_init(&mainloop, &reconnection_timer);
@@ -5,7 +5,7 @@
 #include "chatsession.h"
 #include "optionargs.h"
 
-enum optionIndex { UNKNOWN, HELP, PORT, ADDRESS, NAME };
+enum optionIndex { UNKNOWN, HELP, PORT, ADDRESS, NAME, BINARY };
 const option::Descriptor usage[] =
 {
     {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: Client -p PORT -n NICKNAME -a SERVER_ADDRESS" },
@@ -13,6 +13,7 @@ const option::Descriptor usage[] =
     {PORT, 0, "p", "port", Arg::Numeric, "-p <port>, \t --port=<port> \t(number)"},
     {ADDRESS, 0, "a", "address", Arg::Required, "-a <ip address>, \t--address=<ip address>" },
     {NAME, 0, "n", "name", Arg::NonEmpty, "-n <name>\t--name==<name>, \t cannot be empty"},
+    {BINARY, 0, "b", "binary", Arg::None, "-b, \t--binary \t use the length-prefixed v2 protocol"},
     { 0, 0, 0, 0, 0, 0 },
 };
 
@@ -72,7 +73,8 @@ int main(int argc, char* argv[])
         ChatSession* session = ChatSession::GetInstance();
         session->Init(std::stoi(options[PORT].arg),
                       options[ADDRESS].arg,
-                      options[NAME].arg);
+                      options[NAME].arg,
+                      options[BINARY] ? WireProtocol::V2 : WireProtocol::Legacy);
     }
     catch (std::exception& e)
     {
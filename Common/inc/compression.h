@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// zlib streams for compressed v2 payloads. Built without zlib (HAVE_ZLIB
+// unset) the codec is simply unavailable and both calls fail.
+bool CompressionAvailable();
+
+// replaces out; false if compression failed
+bool Deflate(const char* data, size_t len, std::vector<char>* out);
+// replaces out; false on corrupt input or output beyond max_len
+bool Inflate(const char* data, size_t len, size_t max_len, std::vector<char>* out);
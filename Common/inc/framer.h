@@ -0,0 +1,204 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+#include <cstddef>
+
+// Non-owning view of one complete frame, without its delimiter.
+// Points either into the caller's read buffer or into the splitter's
+// partial buffer and is only valid during the callback it is passed to.
+struct FrameView
+{
+    const char* data;
+    size_t size;
+
+    std::string ToString() const
+    {
+        return std::string(data, size);
+    }
+};
+
+typedef const char* (*find_delimiter_fn)(const char* begin, const char* end, char delimiter);
+
+// Size of the length-prefixed frame starting at data, judged from the
+// first len bytes: FRAME_INCOMPLETE while the header is cut short,
+// FRAME_INVALID for a malformed or oversized header.
+typedef size_t (*frame_length_fn)(const char* data, size_t len);
+static const size_t FRAME_INCOMPLETE = 0;
+static const size_t FRAME_INVALID = (size_t)-1;
+
+// Returns the first occurrence of delimiter in [begin, end) or nullptr.
+// Dispatches once to the widest implementation the CPU supports.
+const char* FindDelimiter(const char* begin, const char* end, char delimiter);
+
+const char* FindDelimiterScalar(const char* begin, const char* end, char delimiter);
+// libc memchr, the fallback on targets without hand-written SIMD
+const char* FindDelimiterMemchr(const char* begin, const char* end, char delimiter);
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAMER_HAS_X86_SIMD 1
+const char* FindDelimiterSSE2(const char* begin, const char* end, char delimiter);
+const char* FindDelimiterAVX2(const char* begin, const char* end, char delimiter);
+bool CpuHasAVX2();
+#endif
+
+// Splits a byte stream into delimiter-terminated or length-prefixed
+// frames. Frames that are completely inside the fed chunk are handed out
+// in place; only a frame that straddles two reads is copied into the
+// partial buffer. Length-prefixed frames are handed out whole, header
+// included, and are never scanned.
+class FrameSplitter
+{
+public:
+    explicit FrameSplitter(char delimiter = 0);
+
+    // switches to length-prefixed framing, measured by frame_length
+    void SetLengthPrefixed(frame_length_fn frame_length);
+    bool IsLengthPrefixed() const;
+    // longest delimited frame accepted, a longer one makes the stream
+    // malformed instead of growing the partial buffer without end
+    void SetMaxFrame(size_t max_frame);
+
+    // Calls on_frame(FrameView) for each complete frame in data; when the
+    // callback returns false the rest of the chunk is discarded.
+    // Returns false if the stream is malformed.
+    template<class Callback>
+    bool Feed(const char* data, size_t len, Callback on_frame);
+
+    bool HasPartial() const;
+    size_t PartialSize() const;
+    // the unfinished frame itself, and putting it back on a new splitter
+    const std::string& Partial() const;
+    void SetPartial(const std::string& data);
+    void Reset();
+    // drops the partial buffer's memory, not just its contents
+    void Release();
+
+protected:
+    template<class Callback>
+    bool FeedDelimited(const char* data, size_t len, Callback on_frame);
+    template<class Callback>
+    bool FeedLengthPrefixed(const char* data, size_t len, Callback on_frame);
+
+    std::string partial;
+    frame_length_fn frame_length;
+    size_t max_frame;
+    char delimiter;
+};
+
+template<class Callback>
+bool FrameSplitter::Feed(const char* data, size_t len, Callback on_frame)
+{
+    if (frame_length != nullptr)
+    {
+        return FeedLengthPrefixed(data, len, on_frame);
+    }
+    return FeedDelimited(data, len, on_frame);
+}
+
+template<class Callback>
+bool FrameSplitter::FeedDelimited(const char* data, size_t len, Callback on_frame)
+{
+    const char* pos = data;
+    const char* end = data + len;
+    while (pos < end)
+    {
+        const char* found = FindDelimiter(pos, end, delimiter);
+        if (found == nullptr)
+        {
+            if (partial.size() + (end - pos) > max_frame)
+            {
+                return false;
+            }
+            partial.append(pos, end - pos);
+            return true;
+        }
+        if (partial.size() + (found - pos) > max_frame)
+        {
+            return false;
+        }
+
+        bool keep_going;
+        if (partial.empty())
+        {
+            keep_going = on_frame(FrameView{pos, (size_t)(found - pos)});
+        }
+        else
+        {
+            partial.append(pos, found - pos);
+            keep_going = on_frame(FrameView{partial.data(), partial.size()});
+            partial.clear();
+        }
+
+        if (!keep_going)
+        {
+            return true;
+        }
+        pos = found + 1;
+    }
+    return true;
+}
+
+template<class Callback>
+bool FrameSplitter::FeedLengthPrefixed(const char* data, size_t len, Callback on_frame)
+{
+    const char* pos = data;
+    const char* end = data + len;
+    while (pos < end)
+    {
+        if (!partial.empty())
+        {
+            size_t needed = frame_length(partial.data(), partial.size());
+            if (needed == FRAME_INVALID)
+            {
+                return false;
+            }
+
+            if (needed == FRAME_INCOMPLETE)
+            {
+                // the header itself is split, it is only a few bytes long
+                partial.push_back(*pos++);
+                continue;
+            }
+
+            size_t take = std::min<size_t>(needed - partial.size(), end - pos);
+            partial.append(pos, take);
+            pos += take;
+            if (partial.size() == needed)
+            {
+                bool keep_going = on_frame(FrameView{partial.data(), partial.size()});
+                partial.clear();
+                if (!keep_going)
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        size_t needed = frame_length(pos, end - pos);
+        if (needed == FRAME_INVALID)
+        {
+            return false;
+        }
+
+        if (needed == FRAME_INCOMPLETE || needed > (size_t)(end - pos))
+        {
+            partial.append(pos, end - pos);
+            return true;
+        }
+
+        if (!on_frame(FrameView{pos, needed}))
+        {
+            return true;
+        }
+        pos += needed;
+    }
+
+    // the chunk ended right after the last header byte of an empty frame
+    if (!partial.empty() && frame_length(partial.data(), partial.size()) == partial.size())
+    {
+        on_frame(FrameView{partial.data(), partial.size()});
+        partial.clear();
+    }
+    return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+
+enum class LogLevel
+{
+    Debug,
+    Info,
+    Warning,
+    Error,
+    None
+};
+
+// Debug logging is compiled out of release builds unless asked for.
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL 1
+#else
+#define LOG_COMPILE_LEVEL 0
+#endif
+#endif
+
+static const size_t LOG_RECORD_TEXT = 240;
+static const size_t LOG_RING_SIZE = 1024; // records per thread, power of two
+
+struct LogRecord
+{
+    uint64_t timestamp_us;
+    LogLevel level;
+    uint16_t length;
+    char text[LOG_RECORD_TEXT];
+};
+
+// Single-producer single-consumer ring; the producer is the thread that
+// owns it, the consumer is the logger's writer thread.
+struct LogRing
+{
+    LogRing();
+
+    // producer and consumer indices on separate cache lines
+    std::atomic<uint32_t> head;
+    char head_pad[64 - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> tail;
+    char tail_pad[64 - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint64_t> dropped;
+    LogRecord records[LOG_RING_SIZE];
+};
+
+// Asynchronous leveled logger. Calling threads format into their own
+// lock-free ring, a background thread batches the rings out to the
+// output. Records are dropped (and counted) when a ring is full.
+class Logger
+{
+public:
+    static Logger* GetInstance();
+
+    // path == nullptr logs to stderr
+    bool Start(const char* path, LogLevel level);
+    void Stop();
+
+    void SetLevel(LogLevel level);
+    bool Enabled(LogLevel level) const;
+
+    void Write(LogLevel level, const char* format, ...)
+#ifdef __GNUC__
+        __attribute__((format(printf, 3, 4)))
+#endif
+        ;
+
+    static bool ParseLevel(const char* name, LogLevel* level);
+
+protected:
+    Logger();
+    ~Logger();
+
+    LogRing* ThreadRing();
+    void WriterLoop();
+    size_t Drain(std::vector<char>& out);
+
+    std::atomic<int> min_level;
+    std::atomic<bool> running;
+
+    std::mutex rings_lock;
+    std::vector<std::unique_ptr<LogRing>> rings;
+
+    FILE* output;
+    std::thread writer;
+};
+
+#define LOG_AT(level, ...) \
+    do \
+    { \
+        Logger* logger_ = Logger::GetInstance(); \
+        if (logger_->Enabled(level)) \
+        { \
+            logger_->Write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#if LOG_COMPILE_LEVEL <= 0
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#define LOG_INFO(...) LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LogLevel::Warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::Error, __VA_ARGS__)
@@ -4,42 +4,124 @@
 #include <vector>
 #include <string>
 #include <memory>
-#include <queue>
+#include <cstdint>
 
 typedef std::vector<char> msg_buffer;
 
-struct MsgReq
-{
-    uv_write_t request;
-};
+class MsgAllocator;
 
+// Encoded payload shared by every write that sends it. The reference
+// count is intrusive and not atomic: a Msg never leaves its loop thread.
+// Msgs are created by a MsgAllocator and return to it on the last Release.
 class Msg
 {
 public:
-    Msg(const std::string& str);
     uv_buf_t* GetBuf();
+    char* Data();
+    size_t Size() const;
+
+    void AddRef();
+    void Release();
+
 protected:
-    msg_buffer buffer;
+    friend class MsgAllocator;
+
+    Msg(MsgAllocator* owner, char* data, size_t size, int size_class);
+    ~Msg();
+
     uv_buf_t cached_buf;
+    MsgAllocator* owner;
+    int refcount;
+    int size_class; // -1 for payloads too big for the slabs
+};
 
-    // just need to save them
-    // those are unused
+struct MsgAllocatorStats
+{
+    uint64_t msgs_created;
+    uint64_t heap_allocations; // slab chunks plus oversize payloads
+    uint64_t oversize_payloads;
+    size_t live_msgs;
+    size_t bytes_in_use;
+    size_t bytes_reserved;
 };
 
-class ReqPool
+// Size-classed slab pools for Msg headers and payload bytes. One allocator
+// per loop; once the free lists are warm, creating and releasing messages
+// does not touch the global allocator.
+class MsgAllocator
 {
 public:
-    ReqPool();
-    uv_write_t* GetNew();
-    void Release();
+    static const int CLASS_COUNT = 6; // 64 bytes to 64 KiB in powers of four
+
+    MsgAllocator();
+    ~MsgAllocator();
+
+    // legacy frame: copies text and appends the NUL delimiter
+    Msg* Create(const char* text, size_t len);
+    Msg* Create(const std::string& text);
+    // uninitialised payload of exactly size bytes for encoders to fill
+    Msg* Allocate(size_t size);
+
+    const MsgAllocatorStats& GetStats() const;
+
 protected:
-    std::queue<std::unique_ptr<uv_write_t>>unused;
-    std::queue<std::unique_ptr<uv_write_t>>used;
+    friend class Msg;
+
+    static size_t ClassSize(int size_class);
+    static int ClassFor(size_t size);
+
+    void Free(Msg* msg);
+    char* AllocateBytes(int size_class);
+    void* AllocateHeader();
+
+    // free blocks are chained through their first bytes
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    FreeBlock* free_bytes[CLASS_COUNT];
+    FreeBlock* free_headers;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    MsgAllocatorStats stats;
+};
+
+// One in-flight uv_write. request.data points back at the context, which
+// holds a reference to the payload until the write completes.
+struct WriteReq
+{
+    uv_write_t request;
+    Msg* payload;
+    // further payloads gathered into the same write, in order
+    std::vector<Msg*> gathered;
+    // bytes over all payloads
+    size_t size;
+    // uv_hrtime() when the write was queued, for latency metrics
+    uint64_t queued_at;
+    // sampled message this write carries, 0 if it isn't traced
+    uint64_t trace_id;
+    // links free contexts in the pool and queued ones in a session backlog
+    WriteReq* next;
 };
 
-class MsgPool
+class WritePool
 {
 public:
-    std::queue<std::shared_ptr<Msg>> messages;
-    ReqPool requests; 
+    WritePool();
+    ~WritePool();
+
+    // takes a reference on payload
+    WriteReq* Acquire(Msg* payload);
+    // one write for count payloads (count > 0), references on all of them
+    WriteReq* Acquire(Msg* const* payloads, size_t count);
+    // drops the payload references and recycles the context
+    void Release(WriteReq* req);
+
+    static WriteReq* FromRequest(uv_write_t* request);
+
+    size_t InFlight() const;
+
+protected:
+    WriteReq* free_list;
+    size_t in_flight;
 };
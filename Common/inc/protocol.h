@@ -0,0 +1,85 @@
+#pragma once
+
+#include "framer.h"
+#include "msg.h"
+
+#include <string>
+#include <cstdint>
+
+// Wire protocols spoken on a chat connection.
+//
+// Legacy: "name\0" followed by "message\0" frames in both directions.
+//
+// V2: length-prefixed binary frames, selected by the client's first frame
+// being a Hello (its first byte is FrameType::Hello, which no legacy name
+// starts with). Every frame is
+//   [type | flags : 1 byte]
+//   [payload length : varint]
+//   [sender id : varint]        if FRAME_FLAG_SENDER
+//   [sequence number : varint]  if FRAME_FLAG_SEQUENCE
+//   [payload]                   zlib stream if FRAME_FLAG_COMPRESSED
+// Varints are unsigned LEB128.
+enum class WireProtocol : uint8_t
+{
+    Unknown,
+    Legacy,
+    V2
+};
+
+static const int WIRE_PROTOCOL_COUNT = 3;
+static const uint8_t PROTOCOL_VERSION = 2;
+
+enum class FrameType : uint8_t
+{
+    Hello = 1,  // payload: [version : 1][capabilities : varint][name]
+    Chat = 2,   // payload: message text
+    System = 3, // payload: server notice text
+    Error = 4   // payload: error text
+};
+
+static const uint8_t FRAME_TYPE_MASK = 0x1F;
+static const uint8_t FRAME_FLAG_COMPRESSED = 0x20;
+static const uint8_t FRAME_FLAG_SEQUENCE = 0x40;
+static const uint8_t FRAME_FLAG_SENDER = 0x80;
+
+static const size_t MAX_FRAME_PAYLOAD = 1024 * 1024;
+static const size_t MAX_VARINT_SIZE = 10;
+
+// Hello capability bits; the server answers with the ones both sides have
+// the peer may send FRAME_FLAG_COMPRESSED frames
+static const uint64_t CAP_DEFLATE = 1;
+
+struct FrameHeader
+{
+    FrameType type;
+    uint8_t flags;
+    uint64_t sender;
+    uint64_t sequence;
+};
+
+struct HelloPayload
+{
+    uint8_t version;
+    uint64_t capabilities;
+    FrameView name;
+};
+
+size_t VarintSize(uint64_t value);
+char* WriteVarint(char* out, uint64_t value);
+// returns bytes consumed, 0 if the input ends early or the varint is too long
+size_t ReadVarint(const char* data, size_t len, uint64_t* value);
+
+// frame_length_fn for FrameSplitter
+size_t MeasureFrame(const char* data, size_t len);
+bool DecodeFrame(FrameView frame, FrameHeader* header, FrameView* payload);
+
+size_t EncodedFrameSize(const FrameHeader& header, size_t payload_len);
+// writes the header and returns where the payload goes
+char* EncodeFrameHeader(char* out, const FrameHeader& header, size_t payload_len);
+Msg* EncodeFrame(MsgAllocator& allocator, const FrameHeader& header, const char* payload, size_t payload_len);
+
+Msg* EncodeHello(MsgAllocator& allocator, uint64_t capabilities, const std::string& name);
+bool DecodeHello(FrameView payload, HelloPayload* hello);
+
+// first byte of a connection tells the protocols apart
+WireProtocol DetectProtocol(char first_byte);
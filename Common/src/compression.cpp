@@ -0,0 +1,131 @@
+#include "compression.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#include <algorithm>
+
+// setting a stream up allocates a few hundred KiB, each thread keeps its own
+struct DeflateStream
+{
+    DeflateStream()
+    {
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        ok = deflateInit(&stream, Z_DEFAULT_COMPRESSION) == Z_OK;
+    }
+
+    ~DeflateStream()
+    {
+        if (ok)
+        {
+            deflateEnd(&stream);
+        }
+    }
+
+    z_stream stream;
+    bool ok;
+};
+
+struct InflateStream
+{
+    InflateStream()
+    {
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        stream.next_in = Z_NULL;
+        stream.avail_in = 0;
+        ok = inflateInit(&stream) == Z_OK;
+    }
+
+    ~InflateStream()
+    {
+        if (ok)
+        {
+            inflateEnd(&stream);
+        }
+    }
+
+    z_stream stream;
+    bool ok;
+};
+
+bool CompressionAvailable()
+{
+    return true;
+}
+
+bool Deflate(const char* data, size_t len, std::vector<char>* out)
+{
+    static thread_local DeflateStream deflater;
+    if (!deflater.ok || deflateReset(&deflater.stream) != Z_OK)
+    {
+        return false;
+    }
+
+    out->resize(deflateBound(&deflater.stream, len));
+    deflater.stream.next_in = (Bytef*)data;
+    deflater.stream.avail_in = len;
+    deflater.stream.next_out = (Bytef*)out->data();
+    deflater.stream.avail_out = out->size();
+    if (deflate(&deflater.stream, Z_FINISH) != Z_STREAM_END)
+    {
+        return false;
+    }
+
+    out->resize(deflater.stream.total_out);
+    return true;
+}
+
+bool Inflate(const char* data, size_t len, size_t max_len, std::vector<char>* out)
+{
+    static thread_local InflateStream inflater;
+    if (!inflater.ok || inflateReset(&inflater.stream) != Z_OK)
+    {
+        return false;
+    }
+
+    out->resize(std::min(max_len, std::max<size_t>(len * 4, 4096)));
+    inflater.stream.next_in = (Bytef*)data;
+    inflater.stream.avail_in = len;
+    size_t produced = 0;
+    for (;;)
+    {
+        inflater.stream.next_out = (Bytef*)out->data() + produced;
+        inflater.stream.avail_out = out->size() - produced;
+        int ret = inflate(&inflater.stream, Z_NO_FLUSH);
+        produced = out->size() - inflater.stream.avail_out;
+        if (ret == Z_STREAM_END)
+        {
+            out->resize(produced);
+            return true;
+        }
+
+        // corrupt, cut short, or bigger than the caller allows
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || inflater.stream.avail_out != 0 || out->size() == max_len)
+        {
+            return false;
+        }
+        out->resize(std::min(max_len, out->size() * 2));
+    }
+}
+
+#else
+
+bool CompressionAvailable()
+{
+    return false;
+}
+
+bool Deflate(const char*, size_t, std::vector<char>*)
+{
+    return false;
+}
+
+bool Inflate(const char*, size_t, size_t, std::vector<char>*)
+{
+    return false;
+}
+
+#endif
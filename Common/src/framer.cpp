@@ -0,0 +1,150 @@
+#include "framer.h"
+
+#include <cstring>
+#include <cstdint>
+
+#ifdef FRAMER_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+const char* FindDelimiterScalar(const char* begin, const char* end, char delimiter)
+{
+    for (const char* pos = begin; pos < end; pos++)
+    {
+        if (*pos == delimiter)
+        {
+            return pos;
+        }
+    }
+    return nullptr;
+}
+
+const char* FindDelimiterMemchr(const char* begin, const char* end, char delimiter)
+{
+    return (const char*)memchr(begin, delimiter, end - begin);
+}
+
+#ifdef FRAMER_HAS_X86_SIMD
+
+const char* FindDelimiterSSE2(const char* begin, const char* end, char delimiter)
+{
+    const __m128i needle = _mm_set1_epi8(delimiter);
+    const char* pos = begin;
+    for (; pos + 16 <= end; pos += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)pos);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return FindDelimiterScalar(pos, end, delimiter);
+}
+
+__attribute__((target("avx2")))
+const char* FindDelimiterAVX2(const char* begin, const char* end, char delimiter)
+{
+    const __m256i needle = _mm256_set1_epi8(delimiter);
+    const char* pos = begin;
+    for (; pos + 64 <= end; pos += 64)
+    {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)pos), needle);
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(pos + 32)), needle);
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(low)
+                      | ((uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32);
+        if (mask != 0)
+        {
+            return pos + __builtin_ctzll(mask);
+        }
+    }
+
+    for (; pos + 32 <= end; pos += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)pos);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return FindDelimiterSSE2(pos, end, delimiter);
+}
+
+bool CpuHasAVX2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static find_delimiter_fn SelectFindDelimiter()
+{
+    return CpuHasAVX2() ? FindDelimiterAVX2 : FindDelimiterSSE2;
+}
+
+#else
+
+static find_delimiter_fn SelectFindDelimiter()
+{
+    return FindDelimiterMemchr;
+}
+
+#endif
+
+const char* FindDelimiter(const char* begin, const char* end, char delimiter)
+{
+    static const find_delimiter_fn impl = SelectFindDelimiter();
+    return impl(begin, end, delimiter);
+}
+
+FrameSplitter::FrameSplitter(char delimiter)
+    : frame_length(nullptr)
+    , max_frame((size_t)-1)
+    , delimiter(delimiter)
+{
+}
+
+void FrameSplitter::SetLengthPrefixed(frame_length_fn frame_length)
+{
+    this->frame_length = frame_length;
+}
+
+void FrameSplitter::SetMaxFrame(size_t max_frame)
+{
+    this->max_frame = max_frame;
+}
+
+bool FrameSplitter::IsLengthPrefixed() const
+{
+    return frame_length != nullptr;
+}
+
+bool FrameSplitter::HasPartial() const
+{
+    return !partial.empty();
+}
+
+size_t FrameSplitter::PartialSize() const
+{
+    return partial.size();
+}
+
+const std::string& FrameSplitter::Partial() const
+{
+    return partial;
+}
+
+void FrameSplitter::SetPartial(const std::string& data)
+{
+    partial = data;
+}
+
+void FrameSplitter::Reset()
+{
+    partial.clear();
+}
+
+void FrameSplitter::Release()
+{
+    std::string().swap(partial);
+}
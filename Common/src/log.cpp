@@ -0,0 +1,237 @@
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <strings.h>
+
+static const int WRITER_IDLE_MS = 5;
+
+static const char* LevelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Debug:
+        return "DEBUG";
+    case LogLevel::Info:
+        return "INFO";
+    case LogLevel::Warning:
+        return "WARN";
+    case LogLevel::Error:
+        return "ERROR";
+    default:
+        return "";
+    }
+}
+
+static uint64_t NowMicroseconds()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+LogRing::LogRing()
+    : head(0)
+    , tail(0)
+    , dropped(0)
+{
+}
+
+Logger* Logger::GetInstance()
+{
+    static Logger logger;
+    return &logger;
+}
+
+Logger::Logger()
+    : min_level((int)LogLevel::Info)
+    , running(false)
+    , output(stderr)
+{
+}
+
+Logger::~Logger()
+{
+    Stop();
+}
+
+bool Logger::Start(const char* path, LogLevel level)
+{
+    Stop();
+
+    output = stderr;
+    if (path != nullptr)
+    {
+        output = fopen(path, "a");
+        if (output == nullptr)
+        {
+            output = stderr;
+            return false;
+        }
+    }
+
+    SetLevel(level);
+    running = true;
+    writer = std::thread([this] ()
+                         {
+                             WriterLoop();
+                         });
+    return true;
+}
+
+void Logger::Stop()
+{
+    if (running.exchange(false))
+    {
+        writer.join();
+        if (output != stderr)
+        {
+            fclose(output);
+            output = stderr;
+        }
+    }
+}
+
+void Logger::SetLevel(LogLevel level)
+{
+    min_level = (int)level;
+}
+
+bool Logger::Enabled(LogLevel level) const
+{
+    return (int)level >= min_level.load(std::memory_order_relaxed);
+}
+
+LogRing* Logger::ThreadRing()
+{
+    // rings are owned by the logger and outlive the threads using them
+    thread_local LogRing* ring = nullptr;
+    if (ring == nullptr)
+    {
+        std::lock_guard<std::mutex> guard(rings_lock);
+        rings.emplace_back(new LogRing());
+        ring = rings.back().get();
+    }
+    return ring;
+}
+
+void Logger::Write(LogLevel level, const char* format, ...)
+{
+    if (!running)
+    {
+        // nobody drains the rings yet, write through
+        va_list args;
+        va_start(args, format);
+        fprintf(output, "%s ", LevelName(level));
+        vfprintf(output, format, args);
+        fputc('\n', output);
+        va_end(args);
+        return;
+    }
+
+    LogRing* ring = ThreadRing();
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SIZE)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord& record = ring->records[head & (LOG_RING_SIZE - 1)];
+    record.timestamp_us = NowMicroseconds();
+    record.level = level;
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(record.text, LOG_RECORD_TEXT, format, args);
+    va_end(args);
+    if (len < 0)
+    {
+        len = 0;
+    }
+    record.length = std::min<size_t>(len, LOG_RECORD_TEXT - 1);
+
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+size_t Logger::Drain(std::vector<char>& out)
+{
+    std::lock_guard<std::mutex> guard(rings_lock);
+
+    size_t records = 0;
+    char prefix[64];
+    for (auto& ring : rings)
+    {
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0)
+        {
+            int len = snprintf(prefix, sizeof(prefix), "WARN %llu log records dropped\n",
+                               (unsigned long long)dropped);
+            out.insert(out.end(), prefix, prefix + len);
+        }
+
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++)
+        {
+            const LogRecord& record = ring->records[tail & (LOG_RING_SIZE - 1)];
+            int len = snprintf(prefix, sizeof(prefix), "%llu.%06llu %s ",
+                               (unsigned long long)(record.timestamp_us / 1000000),
+                               (unsigned long long)(record.timestamp_us % 1000000),
+                               LevelName(record.level));
+            out.insert(out.end(), prefix, prefix + len);
+            out.insert(out.end(), record.text, record.text + record.length);
+            out.push_back('\n');
+            records++;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    return records;
+}
+
+void Logger::WriterLoop()
+{
+    std::vector<char> batch;
+    for (;;)
+    {
+        bool stopping = !running;
+
+        batch.clear();
+        size_t records = Drain(batch);
+        if (!batch.empty())
+        {
+            fwrite(batch.data(), 1, batch.size(), output);
+            fflush(output);
+        }
+
+        if (records == 0)
+        {
+            if (stopping)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(WRITER_IDLE_MS));
+        }
+    }
+}
+
+bool Logger::ParseLevel(const char* name, LogLevel* level)
+{
+    static const LogLevel levels[] = { LogLevel::Debug, LogLevel::Info, LogLevel::Warning, LogLevel::Error };
+    for (LogLevel candidate : levels)
+    {
+        if (strcasecmp(name, LevelName(candidate)) == 0)
+        {
+            *level = candidate;
+            return true;
+        }
+    }
+
+    if (strcasecmp(name, "none") == 0)
+    {
+        *level = LogLevel::None;
+        return true;
+    }
+    return false;
+}
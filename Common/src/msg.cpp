@@ -1,11 +1,23 @@
 #include "msg.h"
 
-Msg::Msg(const std::string& str)
-: buffer(str.begin(), str.end())
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+static const size_t SLAB_CHUNK_SIZE = 64 * 1024;
+static const size_t HEADERS_PER_CHUNK = 256;
+
+Msg::Msg(MsgAllocator* owner, char* data, size_t size, int size_class)
+: owner(owner)
+, refcount(1)
+, size_class(size_class)
+{
+    cached_buf.base = data;
+    cached_buf.len = size;
+}
+
+Msg::~Msg()
 {
-    buffer.push_back(0);
-    cached_buf.base = buffer.data();
-    cached_buf.len = buffer.size();
 }
 
 uv_buf_t* Msg::GetBuf()
@@ -13,28 +25,241 @@ uv_buf_t* Msg::GetBuf()
     return &cached_buf;
 }
 
-ReqPool::ReqPool()
+char* Msg::Data()
+{
+    return cached_buf.base;
+}
+
+size_t Msg::Size() const
+{
+    return cached_buf.len;
+}
+
+void Msg::AddRef()
+{
+    refcount++;
+}
+
+void Msg::Release()
+{
+    if (--refcount == 0)
+    {
+        owner->Free(this);
+    }
+}
+
+MsgAllocator::MsgAllocator()
+    : free_headers(nullptr)
+    , stats()
+{
+    for (auto& free_list : free_bytes)
+    {
+        free_list = nullptr;
+    }
+}
+
+MsgAllocator::~MsgAllocator()
+{
+}
+
+size_t MsgAllocator::ClassSize(int size_class)
+{
+    return (size_t)64 << (2 * size_class);
+}
+
+int MsgAllocator::ClassFor(size_t size)
+{
+    for (int size_class = 0; size_class < CLASS_COUNT; size_class++)
+    {
+        if (size <= ClassSize(size_class))
+        {
+            return size_class;
+        }
+    }
+    return -1;
+}
+
+char* MsgAllocator::AllocateBytes(int size_class)
+{
+    size_t block = ClassSize(size_class);
+    if (free_bytes[size_class] == nullptr)
+    {
+        // carve a fresh chunk into blocks of this class
+        size_t chunk_size = std::max(SLAB_CHUNK_SIZE, block);
+        chunks.emplace_back(new char[chunk_size]);
+        stats.heap_allocations++;
+        stats.bytes_reserved += chunk_size;
+
+        char* base = chunks.back().get();
+        for (size_t offset = 0; offset + block <= chunk_size; offset += block)
+        {
+            FreeBlock* free_block = reinterpret_cast<FreeBlock*>(base + offset);
+            free_block->next = free_bytes[size_class];
+            free_bytes[size_class] = free_block;
+        }
+    }
+
+    FreeBlock* free_block = free_bytes[size_class];
+    free_bytes[size_class] = free_block->next;
+    return reinterpret_cast<char*>(free_block);
+}
+
+void* MsgAllocator::AllocateHeader()
+{
+    if (free_headers == nullptr)
+    {
+        static_assert(sizeof(Msg) >= sizeof(FreeBlock), "Msg too small for the free list");
+        size_t chunk_size = sizeof(Msg) * HEADERS_PER_CHUNK;
+        chunks.emplace_back(new char[chunk_size]);
+        stats.heap_allocations++;
+        stats.bytes_reserved += chunk_size;
+
+        char* base = chunks.back().get();
+        for (size_t i = 0; i < HEADERS_PER_CHUNK; i++)
+        {
+            FreeBlock* free_block = reinterpret_cast<FreeBlock*>(base + i * sizeof(Msg));
+            free_block->next = free_headers;
+            free_headers = free_block;
+        }
+    }
+
+    FreeBlock* free_block = free_headers;
+    free_headers = free_block->next;
+    return free_block;
+}
+
+Msg* MsgAllocator::Allocate(size_t size)
+{
+    int size_class = ClassFor(size);
+    char* data;
+    if (size_class < 0)
+    {
+        data = new char[size];
+        stats.heap_allocations++;
+        stats.oversize_payloads++;
+    }
+    else
+    {
+        data = AllocateBytes(size_class);
+    }
+
+    stats.msgs_created++;
+    stats.live_msgs++;
+    stats.bytes_in_use += size;
+    return new (AllocateHeader()) Msg(this, data, size, size_class);
+}
+
+Msg* MsgAllocator::Create(const char* text, size_t len)
+{
+    Msg* msg = Allocate(len + 1);
+    memcpy(msg->Data(), text, len);
+    msg->Data()[len] = 0;
+    return msg;
+}
+
+Msg* MsgAllocator::Create(const std::string& text)
 {
+    return Create(text.data(), text.size());
 }
 
-uv_write_t* ReqPool::GetNew()
+void MsgAllocator::Free(Msg* msg)
 {
-    if (unused.empty())
+    stats.live_msgs--;
+    stats.bytes_in_use -= msg->Size();
+
+    if (msg->size_class < 0)
     {
-        used.push(std::move(std::unique_ptr<uv_write_t>(new uv_write_t)));
+        delete[] msg->Data();
     }
     else
     {
-        used.push(std::move(std::unique_ptr<uv_write_t>(unused.front().release())));
-        unused.pop();
+        FreeBlock* free_block = reinterpret_cast<FreeBlock*>(msg->Data());
+        free_block->next = free_bytes[msg->size_class];
+        free_bytes[msg->size_class] = free_block;
     }
 
-    return used.back().get();   
+    msg->~Msg();
+    FreeBlock* free_header = reinterpret_cast<FreeBlock*>(msg);
+    free_header->next = free_headers;
+    free_headers = free_header;
+}
+
+const MsgAllocatorStats& MsgAllocator::GetStats() const
+{
+    return stats;
+}
+
+WritePool::WritePool()
+    : free_list(nullptr)
+    , in_flight(0)
+{
 }
 
-void ReqPool::Release()
+WritePool::~WritePool()
 {
-    unused.push(std::move(std::unique_ptr<uv_write_t>(used.front().release())));
-    used.pop();
+    while (free_list != nullptr)
+    {
+        WriteReq* next = free_list->next;
+        delete free_list;
+        free_list = next;
+    }
 }
 
+WriteReq* WritePool::Acquire(Msg* payload)
+{
+    WriteReq* req = free_list;
+    if (req == nullptr)
+    {
+        req = new WriteReq;
+    }
+    else
+    {
+        free_list = req->next;
+    }
+
+    payload->AddRef();
+    req->payload = payload;
+    req->size = payload->Size();
+    req->trace_id = 0;
+    req->next = nullptr;
+    req->request.data = req;
+    in_flight++;
+    return req;
+}
+
+WriteReq* WritePool::Acquire(Msg* const* payloads, size_t count)
+{
+    WriteReq* req = Acquire(payloads[0]);
+    for (size_t i = 1; i < count; i++)
+    {
+        payloads[i]->AddRef();
+        req->gathered.push_back(payloads[i]);
+        req->size += payloads[i]->Size();
+    }
+    return req;
+}
+
+void WritePool::Release(WriteReq* req)
+{
+    req->payload->Release();
+    req->payload = nullptr;
+    for (Msg* payload : req->gathered)
+    {
+        payload->Release();
+    }
+    // keeps its capacity for the next gathered write
+    req->gathered.clear();
+    req->next = free_list;
+    free_list = req;
+    in_flight--;
+}
+
+WriteReq* WritePool::FromRequest(uv_write_t* request)
+{
+    return static_cast<WriteReq*>(request->data);
+}
+
+size_t WritePool::InFlight() const
+{
+    return in_flight;
+}
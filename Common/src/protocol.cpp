@@ -0,0 +1,182 @@
+#include "protocol.h"
+
+#include <cstring>
+
+size_t VarintSize(uint64_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+char* WriteVarint(char* out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+size_t ReadVarint(const char* data, size_t len, uint64_t* value)
+{
+    uint64_t result = 0;
+    for (size_t i = 0; i < len && i < MAX_VARINT_SIZE; i++)
+    {
+        uint8_t byte = (uint8_t)data[i];
+        result |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// parses the header, returns its size or FRAME_INCOMPLETE / FRAME_INVALID
+static size_t ParseHeader(const char* data, size_t len, FrameHeader* header, uint64_t* payload_len)
+{
+    if (len == 0)
+    {
+        return FRAME_INCOMPLETE;
+    }
+
+    uint8_t first = (uint8_t)data[0];
+    header->type = (FrameType)(first & FRAME_TYPE_MASK);
+    header->flags = first & ~FRAME_TYPE_MASK;
+    header->sender = 0;
+    header->sequence = 0;
+
+    size_t pos = 1;
+    uint64_t* fields[] = { payload_len,
+                           (header->flags & FRAME_FLAG_SENDER) ? &header->sender : nullptr,
+                           (header->flags & FRAME_FLAG_SEQUENCE) ? &header->sequence : nullptr };
+    for (uint64_t* field : fields)
+    {
+        if (field == nullptr)
+        {
+            continue;
+        }
+
+        size_t used = ReadVarint(data + pos, len - pos, field);
+        if (used == 0)
+        {
+            // a varint that ran past MAX_VARINT_SIZE can never complete
+            return len - pos >= MAX_VARINT_SIZE ? FRAME_INVALID : FRAME_INCOMPLETE;
+        }
+        pos += used;
+    }
+
+    if (*payload_len > MAX_FRAME_PAYLOAD)
+    {
+        return FRAME_INVALID;
+    }
+    return pos;
+}
+
+size_t MeasureFrame(const char* data, size_t len)
+{
+    FrameHeader header;
+    uint64_t payload_len = 0;
+    size_t header_size = ParseHeader(data, len, &header, &payload_len);
+    if (header_size == FRAME_INCOMPLETE || header_size == FRAME_INVALID)
+    {
+        return header_size;
+    }
+    return header_size + payload_len;
+}
+
+bool DecodeFrame(FrameView frame, FrameHeader* header, FrameView* payload)
+{
+    uint64_t payload_len = 0;
+    size_t header_size = ParseHeader(frame.data, frame.size, header, &payload_len);
+    if (header_size == FRAME_INCOMPLETE || header_size == FRAME_INVALID
+        || header_size + payload_len != frame.size)
+    {
+        return false;
+    }
+
+    payload->data = frame.data + header_size;
+    payload->size = payload_len;
+    return true;
+}
+
+size_t EncodedFrameSize(const FrameHeader& header, size_t payload_len)
+{
+    size_t size = 1 + VarintSize(payload_len) + payload_len;
+    if (header.flags & FRAME_FLAG_SENDER)
+    {
+        size += VarintSize(header.sender);
+    }
+    if (header.flags & FRAME_FLAG_SEQUENCE)
+    {
+        size += VarintSize(header.sequence);
+    }
+    return size;
+}
+
+char* EncodeFrameHeader(char* out, const FrameHeader& header, size_t payload_len)
+{
+    *out++ = (char)((uint8_t)header.type | header.flags);
+    out = WriteVarint(out, payload_len);
+    if (header.flags & FRAME_FLAG_SENDER)
+    {
+        out = WriteVarint(out, header.sender);
+    }
+    if (header.flags & FRAME_FLAG_SEQUENCE)
+    {
+        out = WriteVarint(out, header.sequence);
+    }
+    return out;
+}
+
+Msg* EncodeFrame(MsgAllocator& allocator, const FrameHeader& header, const char* payload, size_t payload_len)
+{
+    Msg* msg = allocator.Allocate(EncodedFrameSize(header, payload_len));
+    char* out = EncodeFrameHeader(msg->Data(), header, payload_len);
+    memcpy(out, payload, payload_len);
+    return msg;
+}
+
+Msg* EncodeHello(MsgAllocator& allocator, uint64_t capabilities, const std::string& name)
+{
+    FrameHeader header = { FrameType::Hello, 0, 0, 0 };
+    size_t payload_len = 1 + VarintSize(capabilities) + name.size();
+    Msg* msg = allocator.Allocate(EncodedFrameSize(header, payload_len));
+    char* out = EncodeFrameHeader(msg->Data(), header, payload_len);
+    *out++ = (char)PROTOCOL_VERSION;
+    out = WriteVarint(out, capabilities);
+    memcpy(out, name.data(), name.size());
+    return msg;
+}
+
+bool DecodeHello(FrameView payload, HelloPayload* hello)
+{
+    if (payload.size < 2)
+    {
+        return false;
+    }
+
+    hello->version = (uint8_t)payload.data[0];
+    size_t used = ReadVarint(payload.data + 1, payload.size - 1, &hello->capabilities);
+    if (used == 0)
+    {
+        return false;
+    }
+
+    hello->name.data = payload.data + 1 + used;
+    hello->name.size = payload.size - 1 - used;
+    return true;
+}
+
+WireProtocol DetectProtocol(char first_byte)
+{
+    return (uint8_t)first_byte == (uint8_t)FrameType::Hello ? WireProtocol::V2 : WireProtocol::Legacy;
+}
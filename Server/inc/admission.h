@@ -0,0 +1,63 @@
+#pragma once
+
+#include <uv.h>
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// What the accept path lets in. Limits are process-wide, every shard
+// enforces its share.
+struct AdmissionLimits
+{
+    AdmissionLimits();
+
+    // new connections per second from one address and the burst allowed
+    // on top, 0 turns the per-address check off
+    double per_address_rate;
+    double per_address_burst;
+    // open connections that haven't named themselves yet, 0 for no cap
+    size_t max_pending;
+    // time a new connection gets to send its name, trickling doesn't extend it
+    uint64_t name_timeout_ms;
+    // connections accepted per loop iteration before the rest wait a turn
+    size_t accept_batch;
+    // accepting pauses while the loop runs this late
+    uint64_t max_accept_lag_ms;
+};
+
+// Token bucket per source address in a fixed-size open-addressing table.
+// When the probe window is full the bucket touched longest ago gives way;
+// by then it has usually refilled, so forgetting it costs nothing.
+class AddressBuckets
+{
+public:
+    AddressBuckets();
+
+    void Configure(double rate, double burst, size_t capacity);
+    bool IsEnabled() const;
+
+    // takes a token from the address's bucket, false when it is empty
+    bool Take(const sockaddr* address, uint64_t now_ms);
+
+protected:
+    static const size_t PROBE_LIMIT = 8;
+
+    struct Bucket
+    {
+        // IPv6, or IPv4 mapped into it
+        uint8_t address[16];
+        // 0 marks a free slot
+        uint32_t hash;
+        float tokens;
+        // uv_now() of the last refill, truncated; differences still work
+        uint32_t updated_ms;
+    };
+
+    static uint32_t Hash(const uint8_t* address);
+
+    std::vector<Bucket> table;
+    size_t mask;
+    double rate;
+    double burst;
+};
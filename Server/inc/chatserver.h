@@ -3,50 +3,91 @@
 #include <uv.h>
 
 #include "msg.h"
+#include "session.h"
+#include "nameregistry.h"
+#include "timingwheel.h"
+#include "readbufferpool.h"
+#include "outbound.h"
+#include "relay.h"
+#include "rooms.h"
+#include "messagelog.h"
+#include "metrics.h"
+#include "metricsendpoint.h"
+#include "tracing.h"
+#include "handoff.h"
+#include "admission.h"
 
 #include <map>
 #include <queue>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
 
-class ChatSession
+class ChatServer;
+typedef std::function<void(ChatServer*)> shard_task_t;
+
+enum class SlowConsumerPolicy
 {
-public:
-    enum class ReadState
-    {
-        NameRead,
-        MessageRead
-    };
+    DropOldest,
+    DropNewest,
+    Disconnect
+};
 
-    ChatSession();
-    ~ChatSession();
+// Per-session and process-wide budgets for data waiting to be written.
+struct OutboundLimits
+{
+    OutboundLimits();
 
-    void SendMessage(Msg* message);
-    void FinishMessage();
+    // bytes handed to libuv per session before further writes are held back
+    size_t inflight_bytes;
+    // what may wait behind them before the slow-consumer policy kicks in
+    size_t backlog_bytes;
+    size_t backlog_msgs;
+    // ceiling for everything queued or in flight, over all sessions
+    size_t total_bytes;
+    SlowConsumerPolicy policy;
+};
 
-    void AddToMsg(const char* data, size_t len);
+// How fast one session may send frames once it has a name.
+struct SendLimits
+{
+    SendLimits();
 
-    std::string GetMsg() const;
-    std::string GetName() const;
-    ReadState GetReadState() const;
+    // frames per second and how many may come at once, 0 for no limit
+    double rate;
+    double burst;
+    // frames dropped while the sender never backed off long enough to
+    // fill its bucket again, before it is disconnected; 0 only drops
+    uint32_t max_drops;
+};
 
-    std::shared_ptr<uv_tcp_t> connection;
-    std::shared_ptr<uv_timer_t> activity_timer;
+// State shared between all shards of one server process.
+// In the default single-loop mode the group holds exactly one shard.
+struct ShardGroup
+{
+    std::vector<ChatServer*> shards;
 
-    void Activate();
-    void Deactivate();
-    bool IsActive() const;
+    std::mutex names_lock;
+    NameRegistry names;
+    // names.Size(), updated under names_lock and read without it
+    std::atomic<size_t> named_sessions;
+    // broadcasts on their way to the other shards
+    RelayPool relays;
 
-protected:
-    std::string name;
-    std::string next_msg;
+    std::atomic<uint64_t> next_sequence;
+    // bytes queued or in flight towards clients, over all shards
+    std::atomic<size_t> outbound_bytes;
 
-    ReadState state;
-    bool active;
+    ShardGroup()
+        : named_sessions(0)
+        , next_sequence(0)
+        , outbound_bytes(0)
+    {
+    }
 };
 
-typedef std::map<uv_stream_t*, ChatSession> session_map_t;
-typedef std::map<uv_timer_t*, uv_stream_t*> timer_map_t;
-
 class ChatServer
 {
 public:
@@ -55,41 +96,212 @@ public:
         Timeout,
         ConnectionClosed,
         DuplicateName,
+        SlowConsumer,
+        Flooding,
         Error
     };
 
     static ChatServer* GetInstance();
-    int Init(int port);
+    static ChatServer* FromLoop(const uv_loop_t* loop);
+    int Init(int port, int shard_count = 1);
+    void SetOutboundLimits(const OutboundLimits& limits);
+    void SetAdmissionLimits(const AdmissionLimits& limits);
+    void SetSendLimits(const SendLimits& limits);
+    // connections the server should be ready for: session tables and the
+    // name registry are sized for them up front
+    void SetConnectionCapacity(size_t connections);
+    void SetListenBacklog(int backlog);
+    // 0 announces every join and leave
+    void SetPresenceLimit(size_t members);
+    // named sessions that send nothing for this long are dropped
+    void SetIdleTimeout(uint64_t milliseconds);
+    void SetHistorySize(size_t messages);
+    void SetMessageLog(const MessageLogOptions& options);
+    // 0 leaves the Prometheus endpoint off
+    void SetMetricsPort(int port);
+    // hot restart: take over from the process waiting on path, if there
+    // is one, then wait there for a successor in turn
+    void SetHandoffPath(const std::string& path);
 
     void OnNewConnection(uv_stream_t* server, int status);
+    void OnAcceptTurn();
     void OnMsgRecv(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
     void OnMsgSent(uv_write_t* req, int status);
+    bool OnFrame(ChatSession* session, FrameView frame);
+    // false once the sender got disconnected
+    bool OnOverLimit(ChatSession* session);
+    bool OnBinaryFrame(ChatSession* session, FrameView frame);
+    bool OnName(ChatSession* session, FrameView name);
+    bool OnChat(ChatSession* session, FrameView text);
+    void OnJoin(ChatSession* session, const std::string& room_name);
+    void OnLeave(ChatSession* session, const std::string& room_name);
+    void OnDirectMessage(ChatSession* session, const std::string& argument);
 
-    void Broadcast(const std::string& msg);
+    // rooms are per shard, other shards get the message by room name
+    void Broadcast(const std::string& msg, int room = LOBBY_ROOM);
+    void Broadcast(Outbound& message, int room);
+    void BroadcastLocal(Outbound& message, int room);
+    void Post(shard_task_t task);
+    // takes one of relayed's references, released once delivered here
+    void Relay(Relayed* relayed);
+    void OnRelayed(Relayed* relayed);
     void RemoveClient(uv_stream_t* client, bool remove_name_from_list, DisconnectionReason reason);
-    void SendSingleMsg(uv_stream_t* target, std::string message);
+    void SendSingleMsg(uv_stream_t* target, std::string message, FrameType type = FrameType::System);
+    // like SendSingleMsg, for a session that may live on another shard
+    void SendToSession(NameOwner owner, const std::string& message, FrameType type);
 
     void SendData(uv_stream_t* connection, Msg* message);
+    void SendHistory(ChatSession* session, int room);
+    void QueueWrite(ChatSession* session, WriteReq* req);
+    void SubmitWrite(ChatSession* session, WriteReq* req);
+    void FlushBacklog(ChatSession* session);
+    void FinishWrite(WriteReq* req);
+    void OnDeferredWork();
     void OnConnectionClose(uv_handle_t* handle);
+    void CloseSession(ChatSession* session);
 
-    void OnClientTimeout(uv_timer_t* handle);
-    msg_buffer* GetReadBuffer();
+    void OnTimerTick();
+    void OnClientTimeout(ChatSession* session);
+    void OnInbox();
+    void OnAllocBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+
+    void OnSuccessor();
+    void Freeze();
+    void OnDrainTick();
+    void OnShardFrozen(uint32_t shard, ShardState state, const std::vector<SessionState>& sessions);
+    void Thaw();
+    void OnTerminate();
+    void DumpTrace();
+    // stops every shard's loop, Init returns once they are done
+    void Shutdown();
+    void Stop();
 protected:
     ChatServer();
     ~ChatServer();
  
     void AcceptConnections();
+    void AcceptConnection();
+    bool Admit(ChatSession* session);
+    int Listen(int port, bool reuse_port);
+    int StartListening();
+    void StartReading(ChatSession* session);
+    SessionState ExportSession(ChatSession* session);
+    void RestoreSession(const SessionState& state);
+    void Run();
+    // after the loop stopped for good, uv_loop_close refuses open handles
+    void CloseHandles();
+    void ScheduleTimeout(ChatSession* session);
+    uint64_t Deadline(const ChatSession* session) const;
+    bool TakeSendToken(ChatSession* session);
+    // whether joins and leaves are worth telling the room about
+    bool Announces(int room) const;
+    uint64_t NextSequence();
+    void AdaptReadBuffer(ChatSession* session, size_t nread);
+    void ReleaseReadBuffer(ChatSession* session);
 
     uv_loop_t loop;
     uv_tcp_t server;
     bool running;
+    uint32_t shard_id;
+    uint64_t session_counter;
+
+    // room history keeps Msgs alive until destruction, the allocator
+    // has to outlive it
+    MsgAllocator messages;
+    SessionTable open_sessions;
+    RoomTable rooms;
+
+    TimingWheel timers;
+    uv_timer_t wheel_timer;
+    std::vector<WheelNode*> expired_timers;
+    ReadBufferPool read_buffers;
+
+    std::shared_ptr<ShardGroup> group;
+
+    // cross-shard delivery, drained on this shard's loop
+    uv_async_t inbox_async;
+    std::mutex inbox_lock;
+    std::vector<shard_task_t> inbox;
+    // broadcasts from other shards, kept apart so relaying them allocates
+    // nothing; relays_taken is the drained batch and room_scratch the
+    // looked-up room name, both keep their capacity
+    std::vector<Relayed*> relay_inbox;
+    std::vector<Relayed*> relays_taken;
+    std::string room_scratch;
+    std::thread worker;
+
+    WritePool writes;
+    OutboundLimits limits;
+
+    // admission control; a connection stays pending until it has named
+    // itself. Accepting pauses for the rest of a loop iteration once
+    // accept_batch connections came in, or while the loop lags behind,
+    // and the kernel's backlog holds whoever arrives meanwhile
+    AdmissionLimits admission;
+    AddressBuckets address_buckets;
+    size_t pending_sessions;
+    size_t accepts_this_turn;
+    bool accept_paused;
+    uv_prepare_t accept_prepare;
+    // how late the last wheel tick ran
+    uint64_t loop_lag;
+    uint64_t next_tick_due;
+
+    SendLimits send_limits;
+
+    size_t connection_capacity;
+    int listen_backlog;
+    // in rooms with more members on this shard, nobody is told about
+    // joins and leaves: with n members that would be n^2 writes
+    size_t presence_limit;
+    uint64_t idle_timeout;
+
+    // sessions to drop once the current callback has unwound
+    std::vector<SessionRef> slow_consumers;
+    uv_check_t deferred_check;
+
+    size_t history_size;
+    MessageLogOptions log_options;
+    MessageLog message_log;
+
+    MetricsShard* metrics;
+    // start of the read callback being handled
+    uint64_t read_started;
+    int metrics_port;
+    MetricsEndpoint metrics_endpoint;
+    // nullptr unless tracing is on; trace_id is the sampled message being
+    // handled, writes queued meanwhile carry it to their completion
+    TraceRing* trace;
+    uint64_t trace_id;
+    uv_signal_t trace_signal;
+    // SIGUSR1 dumps render and write on the thread pool, one at a time
+    uv_work_t trace_dump;
+    bool trace_dumping;
+    bool trace_written;
+    // scratch space for gathered writes
+    std::vector<Msg*> replay;
+    std::vector<uv_buf_t> gather_bufs;
 
-    session_map_t open_sessions;
-    timer_map_t active_timers;
-    std::vector<std::string> name_list;
-    msg_buffer read_buffer;
+    uv_signal_t term_signals[2];
+    uv_timer_t shutdown_timer;
 
-    MsgPool msg_queue;
+    // hot restart, driven by the first shard: where successors connect,
+    // the one being served and what is collected for it
+    std::string handoff_path;
+    int handoff_listener;
+    uv_poll_t handoff_poll;
+    int successor;
+    HandoffState handoff;
+    size_t frozen_shards;
+    // listening socket handed over by a predecessor, -1 if bound here
+    int inherited_listener;
+    // a frozen shard reads nothing new and drains its writes; once
+    // exported it writes nothing either
+    bool frozen;
+    bool exported;
+    int frozen_listener;
+    uint64_t drain_deadline;
+    uv_timer_t drain_timer;
 };
 
 
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// A session on its way to the successor process.
+struct SessionState
+{
+    SessionState();
+
+    uint32_t shard;
+    uint64_t id;
+    WireProtocol protocol;
+    uint64_t capabilities;
+    // false while the session still has to send its name
+    bool named;
+    std::string name;
+    // bytes of a frame cut short by the last read
+    std::string partial;
+    std::vector<std::string> rooms;
+    // index into rooms of the one chat goes to
+    uint32_t current_room;
+    int fd;
+};
+
+struct ShardState
+{
+    int listener;
+    uint64_t session_counter;
+};
+
+// Everything a successor needs to carry on serving without a reconnect.
+struct HandoffState
+{
+    HandoffState();
+
+    uint64_t next_sequence;
+    std::vector<ShardState> shards;
+    std::vector<SessionState> sessions;
+    // -1 when the metrics endpoint is off
+    int metrics_listener;
+};
+
+// Hot restart runs over a SOCK_SEQPACKET Unix socket. The serving process
+// listens on a path; a successor connects, gets the listening sockets and
+// every session socket through SCM_RIGHTS together with the serialized
+// state, and acknowledges once it has taken them over. All calls block
+// and return 0 or a libuv error code.
+
+// replaces a socket left at path, UV_EEXIST for anything else there; the
+// socket is for its owner only, *fd is non-blocking for polling accepts
+int HandoffListen(const std::string& path, int* fd);
+// UV_EACCES when the successor runs as another user
+int HandoffAccept(int listener, int* fd);
+// UV_ENOENT or UV_ECONNREFUSED: nobody to take over from; UV_EACCES when
+// the server at path runs as another user
+int HandoffConnect(const std::string& path, int* fd);
+
+int SendHandoff(int fd, const HandoffState& state);
+int ReceiveHandoff(int fd, HandoffState* state);
+
+int SendHandoffAck(int fd);
+int WaitHandoffAck(int fd);
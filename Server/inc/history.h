@@ -0,0 +1,33 @@
+#pragma once
+
+#include "outbound.h"
+
+#include <vector>
+#include <memory>
+
+// The last few messages of a room. Entries share the text and encodings
+// of the original broadcast, the deflated v2 frame included, so a replay
+// hands out the very same payloads instead of formatting or compressing
+// anything per joiner.
+class HistoryRing
+{
+public:
+    HistoryRing();
+
+    // drops what is stored; 0 turns the history off
+    void SetCapacity(size_t capacity);
+    void Record(const Outbound& message);
+    // appends one payload per stored message, oldest first; a protocol
+    // nobody used when the message went out is encoded once, here
+    void Collect(WireProtocol protocol, uint64_t capabilities, std::vector<Msg*>* payloads);
+    void Clear();
+
+    size_t Size() const;
+
+protected:
+    std::unique_ptr<Outbound[]> slots;
+    size_t capacity;
+    // next slot to overwrite
+    size_t head;
+    size_t count;
+};
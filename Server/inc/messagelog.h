@@ -0,0 +1,96 @@
+#pragma once
+
+#include <uv.h>
+
+#include "protocol.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <cstdint>
+
+struct MessageLogOptions
+{
+    MessageLogOptions();
+
+    // where segments go, the log is off while empty
+    std::string directory;
+    size_t segment_bytes;
+    // oldest segments are deleted past either limit, 0 means no limit
+    uint64_t retain_bytes;
+    uint64_t retain_seconds;
+    // fdatasync after appends; without it the page cache decides
+    bool sync;
+};
+
+// Append-only log of relayed messages in fixed-size, memory-mapped segment
+// files. Appends are memcpys on the loop thread. fdatasync runs on the libuv
+// thread pool, one job at a time: whatever is appended while a job runs is
+// covered by the next one (group commit).
+class MessageLog
+{
+public:
+    MessageLog();
+    ~MessageLog();
+
+    // name keeps the segments of several shards apart in one directory
+    int Open(uv_loop_t* loop, const MessageLogOptions& options, const std::string& name);
+    bool IsOpen() const;
+
+    void Append(FrameType type,
+                uint64_t sender,
+                uint64_t sequence,
+                const std::string& room,
+                const char* text,
+                size_t len);
+
+    // syncs and unmaps on the calling thread, after a running sync job is
+    // back since it may be syncing the current segment; closed runs then,
+    // right away when no job is out
+    void Close(std::function<void()> closed = nullptr);
+
+protected:
+    struct Segment
+    {
+        std::string path;
+        int fd;
+        char* base;
+        size_t used;
+        // seconds since the epoch of the last append
+        int64_t last_write;
+    };
+
+    int OpenSegment();
+    void Seal();
+    void ScheduleSync();
+    void OnSyncDone(int status);
+    void Finish();
+    void EnforceRetention();
+    std::string SegmentPath(uint64_t index) const;
+
+    uv_loop_t* loop;
+    MessageLogOptions options;
+    std::string name;
+    uint64_t next_index;
+
+    Segment current;
+    // segments on disk that are no longer written to, oldest first
+    std::deque<Segment> sealed;
+
+    // group commit; the job_ vectors belong to the running job
+    uv_work_t sync_work;
+    bool sync_running;
+    bool dirty;
+    // sealed segments whose data has not been synced yet
+    std::vector<int> unsynced_fds;
+    std::vector<std::string> expired;
+    std::vector<int> job_fds;
+    std::vector<std::string> job_unlink;
+    size_t job_sealed;
+    int job_error;
+
+    // Close waits for the running job
+    bool closing;
+    std::function<void()> on_closed;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+enum class Counter
+{
+    ConnectionsAccepted,
+    ConnectionsClosed,
+    ConnectionsRejected,
+    BytesIn,
+    BytesOut,
+    MessagesIn,
+    Broadcasts,
+    WritesCompleted,
+    WriteErrors,
+    WritesDropped,
+    SlowConsumers,
+    MessagesRateLimited,
+    Flooders,
+    COUNT
+};
+
+// up/down values; every thread keeps its share, a scrape adds them up
+enum class Gauge
+{
+    Sessions,
+    PendingSessions,
+    WritesInFlight,
+    BacklogMessages,
+    OutboundBytes,
+    COUNT
+};
+
+enum class Histogram
+{
+    RecvToBroadcast, // read callback until fan-out is queued
+    WriteLatency,    // write queued until libuv reports it done
+    COUNT
+};
+
+// Log-linear latency histogram in the spirit of HdrHistogram: values below
+// 64 us get a bucket each, above that every power of two is split into 32
+// buckets, so any recorded value is off by at most ~3%.
+struct LatencyHistogram
+{
+    static const int SUB_BUCKETS = 32;
+    // covers values below 2^33 us (about 2.4 hours), larger ones land in
+    // the last bucket
+    static const int BUCKET_COUNT = 29 * SUB_BUCKETS;
+
+    LatencyHistogram();
+
+    void Record(uint64_t value_us);
+    // adds other's counts; other may still be written to
+    void Merge(const LatencyHistogram& other);
+    uint64_t Count() const;
+    // upper bound of the value below which the given fraction falls
+    uint64_t ValueAtQuantile(double quantile) const;
+
+    static int BucketFor(uint64_t value_us);
+    // highest value that lands in the bucket
+    static uint64_t BucketLimit(int bucket);
+
+    std::atomic<uint64_t> counts[BUCKET_COUNT];
+    std::atomic<uint64_t> sum_us;
+};
+
+// Metrics of one thread. Only the owning thread writes, scrapes read with
+// relaxed loads, so updates are plain uncontended atomic adds.
+class MetricsShard
+{
+public:
+    MetricsShard();
+
+    void Add(Counter counter, uint64_t amount = 1)
+    {
+        std::atomic<uint64_t>& value = counters[(int)counter];
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void Adjust(Gauge gauge, int64_t delta)
+    {
+        std::atomic<int64_t>& value = gauges[(int)gauge];
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void Record(Histogram histogram, uint64_t nanoseconds)
+    {
+        histograms[(int)histogram].Record(nanoseconds / 1000);
+    }
+
+protected:
+    friend class MetricsRegistry;
+
+    // keeps a neighbouring shard's hot counters off our first cache line
+    char front_pad[64];
+    std::atomic<uint64_t> counters[(int)Counter::COUNT];
+    std::atomic<int64_t> gauges[(int)Gauge::COUNT];
+    LatencyHistogram histograms[(int)Histogram::COUNT];
+    char back_pad[64];
+};
+
+class MetricsRegistry
+{
+public:
+    static MetricsRegistry* GetInstance();
+
+    // one per thread that updates metrics, lives as long as the process
+    MetricsShard* Register();
+
+    // Prometheus text exposition format, version 0.0.4
+    void Render(std::string* out);
+
+protected:
+    MetricsRegistry();
+
+    std::mutex shards_lock;
+    std::vector<std::unique_ptr<MetricsShard>> shards;
+};
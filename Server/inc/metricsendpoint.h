@@ -0,0 +1,43 @@
+#pragma once
+
+#include <uv.h>
+
+#include <string>
+
+// Serves MetricsRegistry::Render over plain HTTP on its own port, and the
+// trace dump on /trace while tracing is on. Scrapes are rare and tiny,
+// every one gets its own heap-allocated connection. The trace is rendered
+// on the thread pool.
+class MetricsEndpoint
+{
+public:
+    MetricsEndpoint();
+
+    int Listen(uv_loop_t* loop, int port);
+    // serves on an already bound socket, the one a predecessor handed over
+    int Adopt(uv_loop_t* loop, int fd);
+    // stops serving and returns a duplicate of the listening socket,
+    // -1 if there is none
+    int Detach();
+
+protected:
+    struct Scrape
+    {
+        uv_tcp_t handle;
+        uv_write_t write;
+        uv_work_t render;
+        std::string request;
+        std::string body;
+        std::string response;
+    };
+
+    int StartListening();
+    void OnConnection(uv_stream_t* server, int status);
+    void OnRead(Scrape* scrape, ssize_t nread, const uv_buf_t* buf);
+    void Respond(Scrape* scrape);
+    static void Send(Scrape* scrape, const char* status, const char* type);
+    static void Close(Scrape* scrape);
+
+    uv_tcp_t server;
+    bool listening;
+};
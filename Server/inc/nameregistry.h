@@ -0,0 +1,52 @@
+#pragma once
+
+#include "session.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Where a registered name lives: the shard that owns the session and a
+// generation-checked reference into that shard's session table.
+struct NameOwner
+{
+    uint32_t shard;
+    SessionRef session;
+};
+
+// Case-folded open-addressing (linear probing) hash of names.
+// Name bytes are interned in one arena, entries only keep offsets into it.
+class NameRegistry
+{
+public:
+    NameRegistry();
+
+    // returns false if the name is already registered
+    bool Insert(const std::string& name, NameOwner owner);
+    bool Find(const std::string& name, NameOwner* owner) const;
+    bool Remove(const std::string& name);
+
+    size_t Size() const;
+    // makes room for this many names without rehashing
+    void Reserve(size_t names);
+
+protected:
+    struct Entry
+    {
+        uint32_t hash;
+        uint32_t offset;
+        uint32_t length; // 0 marks an empty bucket
+        NameOwner owner;
+    };
+
+    static uint32_t Hash(const char* name, size_t len);
+    bool Matches(const Entry& entry, uint32_t hash, const char* name, size_t len) const;
+    size_t Locate(uint32_t hash, const char* name, size_t len) const;
+    void Grow();
+    void Compact();
+
+    std::vector<Entry> table;
+    std::vector<char> arena;
+    size_t count;
+    size_t garbage;
+};
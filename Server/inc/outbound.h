@@ -0,0 +1,51 @@
+#pragma once
+
+#include "msg.h"
+#include "protocol.h"
+
+#include <cstdint>
+
+// One logical message from the server. The canonical copy is the text
+// followed by a NUL, which doubles as the legacy frame unless the text
+// itself contains NULs. Wire encodings are built on first use and shared
+// by every recipient speaking that protocol; a v2 frame compressed for
+// peers that negotiated deflate is likewise built once.
+class Outbound
+{
+public:
+    // empty until Assign fills it
+    Outbound();
+    Outbound(MsgAllocator* allocator, FrameType type, uint64_t sender, uint64_t sequence);
+    ~Outbound();
+
+    void SetText(const char* text, size_t len);
+    // takes over the caller's reference to an already composed text + NUL
+    void AdoptText(Msg* text);
+    // drops everything held and shares other's text and encodings instead
+    void Assign(const Outbound& other);
+    void Clear();
+
+    Msg* Encode(WireProtocol protocol, uint64_t capabilities = 0);
+
+    const char* Text();
+    size_t TextSize();
+    FrameType Type() const;
+    uint64_t Sender() const;
+    uint64_t Sequence() const;
+
+protected:
+    Outbound(const Outbound&);
+    FrameHeader Header() const;
+    Msg* EncodeCompressed();
+
+    Outbound& operator=(const Outbound&);
+
+    MsgAllocator* allocator;
+    FrameType type;
+    uint64_t sender;
+    uint64_t sequence;
+    Msg* text;
+    Msg* encodings[WIRE_PROTOCOL_COUNT];
+    // v2 frame for deflate peers, the plain one when compressing didn't pay
+    Msg* compressed;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Per-loop pool of read buffers in a few power-of-four size classes.
+// Not thread safe: every shard owns its own pool, and a buffer stays with
+// the session that acquired it until the session gives it back.
+class ReadBufferPool
+{
+public:
+    static const int CLASS_COUNT = 4;
+
+    ReadBufferPool();
+    ~ReadBufferPool();
+
+    static size_t ClassSize(int size_class);
+    // largest class whose buffers fit into size, never below class 0
+    static int ClassFor(size_t size);
+
+    char* Acquire(int size_class);
+    void Release(char* buffer, int size_class);
+
+    size_t BytesInUse() const;
+    size_t BytesPooled() const;
+
+protected:
+    // free buffers kept per class, the rest go back to the allocator
+    static const size_t KEEP_FREE = 64;
+
+    std::vector<char*> free_lists[CLASS_COUNT];
+    size_t bytes_in_use;
+    size_t bytes_pooled;
+};
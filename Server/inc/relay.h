@@ -0,0 +1,83 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class RelayPool;
+
+// A broadcast handed from the shard it came in on to the others: the
+// room name and text in one block, with the header fields next to them.
+// Nobody writes to it once posted. Unlike a Msg it crosses threads, so
+// the reference count is atomic; the last target to release it returns
+// the block to the group's pool.
+class Relayed
+{
+public:
+    const char* Room() const;
+    size_t RoomSize() const;
+    const char* Text() const;
+    size_t TextSize() const;
+
+    FrameType Type() const;
+    uint64_t Sender() const;
+    uint64_t Sequence() const;
+    uint64_t TraceId() const;
+
+    void Release();
+
+protected:
+    friend class RelayPool;
+
+    Relayed(RelayPool* owner, int size_class, int references);
+
+    RelayPool* owner;
+    std::atomic<int> refcount;
+    int size_class; // -1 for blocks too big for the pool
+    FrameType type;
+    uint64_t sender;
+    uint64_t sequence;
+    uint64_t trace_id;
+    uint32_t room_size;
+    uint32_t text_size;
+};
+
+// Size-classed free lists of relay blocks, shared by all shards of a
+// group. Blocks are kept once allocated, so a warm pool posts messages
+// without touching the global allocator; the lock only guards a list
+// push or pop.
+class RelayPool
+{
+public:
+    static const int CLASS_COUNT = 5; // 256 bytes to 64 KiB in powers of four
+
+    RelayPool();
+    ~RelayPool();
+
+    // one reference per target shard, each releases it once
+    Relayed* Create(const std::string& room, const char* text, size_t len,
+                    FrameType type, uint64_t sender, uint64_t sequence, uint64_t trace_id,
+                    int references);
+
+protected:
+    friend class Relayed;
+
+    static size_t ClassSize(int size_class);
+    static int ClassFor(size_t size);
+
+    void Free(Relayed* relayed);
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    std::mutex lock;
+    FreeBlock* free_blocks[CLASS_COUNT];
+    std::vector<std::unique_ptr<char[]>> blocks;
+};
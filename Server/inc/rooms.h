@@ -0,0 +1,65 @@
+#pragma once
+
+#include "history.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+class ChatSession;
+
+// rooms per shard, a session's membership fits one 64-bit mask
+static const int MAX_ROOMS = 64;
+// rooms a single session may be in at the same time
+static const int MAX_JOINED_ROOMS = 8;
+static const size_t MAX_ROOM_NAME = 32;
+// everyone lands here after naming themselves
+static const int LOBBY_ROOM = 0;
+
+// A session's seat in one room: its index in that room's member vector.
+struct RoomSeat
+{
+    uint32_t room;
+    uint32_t pos;
+};
+
+// Named rooms of one shard. Every room keeps a dense vector of its members
+// so fan-out touches only them; sessions remember their positions so
+// leaving is a swap-remove.
+class RoomTable
+{
+public:
+    RoomTable();
+
+    // -1 if there is no such room
+    int Find(const std::string& name) const;
+    // finds or creates the room, -1 when the shard is out of rooms
+    int Open(const std::string& name);
+
+    // false if the session already is a member or has no seats left
+    bool Join(int room, ChatSession* session);
+    bool Leave(int room, ChatSession* session);
+    void LeaveAll(ChatSession* session);
+
+    const std::vector<ChatSession*>& Members(int room) const;
+    void ReserveMembers(int room, size_t members);
+    const std::string& Name(int room) const;
+    HistoryRing& History(int room);
+    void SetHistorySize(size_t messages);
+
+    // folds to lowercase, false if the name can't be a room name
+    static bool Normalize(const std::string& name, std::string* room);
+
+protected:
+    struct Room
+    {
+        std::string name;
+        std::vector<ChatSession*> members;
+        HistoryRing history;
+    };
+
+    Room rooms[MAX_ROOMS];
+    std::unordered_map<std::string, int> by_name;
+    std::vector<int> free_rooms;
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <uv.h>
+
+#include "msg.h"
+#include "framer.h"
+#include "protocol.h"
+#include "timingwheel.h"
+#include "rooms.h"
+#include "outbound.h"
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+// What an idle connection may cost in user space: both halves of its
+// session, its entries in the table's index vectors, its lobby seat and
+// its registered name. Read buffers and partial frames are returned while
+// idle. At this budget a million idle connections need 768 MB plus the
+// kernel's socket memory.
+static const size_t IDLE_SESSION_BUDGET = 768;
+
+// The parts of a session only its own reads, joins and leaves touch.
+// Kept apart so that fan-out and timer sweeps walk fewer cache lines.
+struct SessionDetails
+{
+    std::string name;
+    // holds the bytes of a frame cut short by the last read
+    FrameSplitter framer;
+    RoomSeat seats[MAX_JOINED_ROOMS];
+};
+
+// The hot part of a session: the libuv handle, the wheel entry and what
+// every write, read and timer expiry looks at. The table allocates it
+// together with its details.
+class ChatSession
+{
+public:
+    enum class ReadState : uint8_t
+    {
+        NameRead,
+        MessageRead
+    };
+
+    ChatSession();
+    ~ChatSession();
+
+    void Reset();
+
+    void SendMessage(Msg* message);
+    // stores the folded name and moves on to reading messages
+    void SetName(FrameView frame);
+
+    const std::string& GetName() const;
+    ReadState GetReadState() const;
+
+    uv_stream_t* GetStream();
+
+    // the handle and the wheel entry point back to the session through data
+    uv_tcp_t connection;
+    WheelNode idle_timer;
+    uint64_t last_activity;
+    // sender id on the wire, unique across shards
+    uint64_t id;
+    uint64_t capabilities;
+
+    // outbound accounting: bytes handed to libuv and a FIFO of writes
+    // held back until those complete
+    size_t inflight_bytes;
+    WriteReq* backlog_head;
+    WriteReq* backlog_tail;
+    size_t backlog_bytes;
+    size_t backlog_msgs;
+
+    // read buffer borrowed from the shard's pool, nullptr while idle
+    char* read_buf;
+
+    // room membership: a mask for quick tests, the seats for leaving are
+    // in the details; chat goes to current_room
+    uint64_t room_bits;
+    int current_room;
+
+    // frames this session may still send, refilled from uv_now(); strikes
+    // are frames dropped since the sender last let the bucket fill up
+    float send_tokens;
+    uint32_t send_updated_ms;
+    uint32_t send_strikes;
+
+    uint32_t slot;
+    uint32_t generation;
+
+    uint8_t read_class;
+    uint8_t full_reads;
+    uint8_t small_reads;
+    uint8_t seat_count;
+    WireProtocol protocol;
+    bool disconnect_pending;
+
+    SessionDetails* details;
+
+    void Activate();
+    void Deactivate();
+    bool IsActive() const;
+
+protected:
+    ReadState state;
+    bool active;
+};
+
+// Hands each member the encoding of message for its wire format, built
+// by the first member speaking it, through send(session, payload).
+// BroadcastLocal queues the writes; the broadcast benchmark runs the same
+// loop with writes that only collect.
+template<class Send>
+void FanOut(Outbound& message, const std::vector<ChatSession*>& members, Send send)
+{
+    for (ChatSession* session : members)
+    {
+        send(session, message.Encode(session->protocol, session->capabilities));
+    }
+}
+
+// Generation-checked reference to a session slot; stays safe to hold
+// after the session is gone, unlike a raw pointer.
+struct SessionRef
+{
+    uint32_t slot;
+    uint32_t generation;
+};
+
+// Slab of sessions with stable addresses. Slots are reused through a free
+// list, live sessions are additionally kept in a dense vector for fan-out.
+class SessionTable
+{
+public:
+    SessionTable();
+
+    ChatSession* Acquire();
+    void Release(ChatSession* session);
+
+    ChatSession* Find(SessionRef ref) const;
+    SessionRef MakeRef(const ChatSession* session) const;
+
+    const std::vector<ChatSession*>& Live() const;
+    size_t Size() const;
+    // allocates slots for this many sessions up front
+    void Reserve(size_t sessions);
+
+protected:
+    static const size_t CHUNK_SIZE = 1024;
+
+    ChatSession* SlotAt(uint32_t slot) const;
+    void AddChunks(size_t count);
+
+    // hot halves and details of the same slots, one chunk each
+    std::vector<std::unique_ptr<ChatSession[]>> chunks;
+    std::vector<std::unique_ptr<SessionDetails[]>> detail_chunks;
+    std::vector<uint32_t> free_slots;
+    // position of every slot inside live, valid while the slot is in use
+    std::vector<uint32_t> live_index;
+    std::vector<ChatSession*> live;
+};
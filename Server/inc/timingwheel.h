@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Intrusive timer entry, embedded into whatever owns the deadline.
+struct WheelNode
+{
+    WheelNode();
+
+    WheelNode* prev;
+    WheelNode* next;
+    uint64_t expiry; // in ticks
+    void* data;
+
+    bool IsScheduled() const;
+};
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS buckets each, every
+// level covering SLOTS times the span of the one below it. Scheduling and
+// cancelling are O(1); far deadlines cascade down as time advances.
+class TimingWheel
+{
+public:
+    TimingWheel();
+
+    void Start(uint64_t now_tick);
+    void Schedule(WheelNode* node, uint64_t expiry_tick);
+    void Cancel(WheelNode* node);
+
+    // moves the wheel forward and collects every node whose deadline passed
+    void Advance(uint64_t now_tick, std::vector<WheelNode*>& expired);
+
+    uint64_t CurrentTick() const;
+
+protected:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 4;
+
+    void Insert(WheelNode* node);
+    void Cascade();
+
+    // each bucket is a circular list with a sentinel head
+    WheelNode buckets[LEVELS][SLOTS];
+    uint64_t current_tick;
+};
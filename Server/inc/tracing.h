@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+// Where a sampled message was seen, in the order it passes them.
+enum class TracePoint : uint8_t
+{
+    Read,      // start of the read callback that brought it in
+    Frame,     // its frame was complete and handed to OnChat
+    Broadcast, // fan-out on one shard queued, arg: recipients
+    WriteDone  // one recipient's write completed, arg: status != 0
+};
+
+struct TraceOptions
+{
+    TraceOptions();
+
+    // one in sample_every chat messages is traced, 0 turns tracing off
+    uint32_t sample_every;
+    // events kept per shard, rounded up to a power of two
+    size_t ring_events;
+    // written on SIGUSR1
+    std::string path;
+};
+
+// Events of one thread in a fixed ring that overwrites the oldest entries.
+// The owning thread is the only writer; a dump copies the ring without
+// stopping it and drops whatever was overwritten while it copied.
+class TraceRing
+{
+public:
+    TraceRing(uint32_t thread, uint32_t sample_every, size_t capacity);
+
+    // id for the next chat message, 0 if it isn't sampled
+    uint64_t Sample()
+    {
+        if (--countdown != 0)
+        {
+            return 0;
+        }
+        countdown = sample_every;
+        return ((uint64_t)(thread + 1) << 40) | ++sampled;
+    }
+
+    void Record(TracePoint point, uint64_t id, uint64_t timestamp_ns, uint32_t arg = 0)
+    {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        Slot& slot = slots[pos & mask];
+        slot.timestamp.store(timestamp_ns, std::memory_order_relaxed);
+        slot.id.store(id, std::memory_order_relaxed);
+        slot.info.store((uint64_t)arg << 8 | (uint64_t)point, std::memory_order_relaxed);
+        head.store(pos + 1, std::memory_order_release);
+    }
+
+protected:
+    friend class Tracer;
+
+    struct Slot
+    {
+        std::atomic<uint64_t> timestamp;
+        std::atomic<uint64_t> id;
+        std::atomic<uint64_t> info;
+    };
+
+    uint32_t thread;
+    uint32_t sample_every;
+    uint32_t countdown;
+    uint64_t sampled;
+    uint64_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> head;
+};
+
+class Tracer
+{
+public:
+    static Tracer* GetInstance();
+
+    void Configure(const TraceOptions& options);
+    bool IsEnabled() const;
+
+    // nullptr while tracing is off, which is what keeps it free then
+    TraceRing* Register(uint32_t thread);
+
+    // Chrome trace-event JSON, loads in chrome://tracing and Perfetto
+    void Render(std::string* out);
+    bool WriteFile();
+
+protected:
+    Tracer();
+
+    TraceOptions options;
+    std::mutex rings_lock;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+};
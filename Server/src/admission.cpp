@@ -0,0 +1,111 @@
+#include "admission.h"
+
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+
+AdmissionLimits::AdmissionLimits()
+    : per_address_rate(0)
+    , per_address_burst(0)
+    , max_pending(16384)
+    , name_timeout_ms(3000)
+    , accept_batch(64)
+    , max_accept_lag_ms(100)
+{
+}
+
+AddressBuckets::AddressBuckets()
+    : mask(0)
+    , rate(0)
+    , burst(0)
+{
+}
+
+void AddressBuckets::Configure(double rate, double burst, size_t capacity)
+{
+    this->rate = rate;
+    this->burst = std::max(1.0, burst);
+    if (rate <= 0)
+    {
+        table.clear();
+        return;
+    }
+
+    size_t size = PROBE_LIMIT;
+    while (size < capacity)
+    {
+        size *= 2;
+    }
+    table.assign(size, Bucket());
+    mask = size - 1;
+}
+
+bool AddressBuckets::IsEnabled() const
+{
+    return !table.empty();
+}
+
+uint32_t AddressBuckets::Hash(const uint8_t* address)
+{
+    // FNV-1a, never 0 so that it can mark free slots
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 16; i++)
+    {
+        hash ^= address[i];
+        hash *= 16777619u;
+    }
+    return hash | 1;
+}
+
+bool AddressBuckets::Take(const sockaddr* address, uint64_t now_ms)
+{
+    uint8_t key[16] = {};
+    if (address->sa_family == AF_INET)
+    {
+        const sockaddr_in* v4 = reinterpret_cast<const sockaddr_in*>(address);
+        key[10] = 0xFF;
+        key[11] = 0xFF;
+        memcpy(key + 12, &v4->sin_addr, 4);
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        memcpy(key, &reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr, 16);
+    }
+
+    uint32_t hash = Hash(key);
+    uint32_t now = (uint32_t)now_ms;
+    Bucket* victim = nullptr;
+    for (size_t probe = 0; probe < PROBE_LIMIT; probe++)
+    {
+        Bucket& bucket = table[(hash + probe) & mask];
+        if (bucket.hash == hash && memcmp(bucket.address, key, sizeof(key)) == 0)
+        {
+            double refill = (uint32_t)(now - bucket.updated_ms) * rate / 1000.0;
+            double tokens = std::min(burst, bucket.tokens + refill);
+            bucket.updated_ms = now;
+            if (tokens < 1)
+            {
+                bucket.tokens = tokens;
+                return false;
+            }
+            bucket.tokens = tokens - 1;
+            return true;
+        }
+
+        if (bucket.hash == 0)
+        {
+            victim = &bucket;
+            break;
+        }
+        if (victim == nullptr || (uint32_t)(now - bucket.updated_ms) > (uint32_t)(now - victim->updated_ms))
+        {
+            victim = &bucket;
+        }
+    }
+
+    memcpy(victim->address, key, sizeof(key));
+    victim->hash = hash;
+    victim->tokens = burst - 1;
+    victim->updated_ms = now;
+    return true;
+}
@@ -1,119 +1,501 @@
 #include "chatserver.h"
+#include "log.h"
 #include <stdio.h>
 #include <iostream>
 #include <cstring>
 #include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
 
 static const int DEFAULT_BACKLOG = 100;
+// optional protocol features this server can agree to
+#ifdef HAVE_ZLIB
+static const uint64_t SERVER_CAPABILITIES = CAP_DEFLATE;
+#else
+static const uint64_t SERVER_CAPABILITIES = 0;
+#endif
 static const int DISCONNECTION_TIME = 10000;
+static const int WHEEL_TICK_MS = 100;
+// source addresses each shard keeps connection rates for
+static const size_t ADDRESS_BUCKETS = 4096;
+// consecutive full reads before a session moves to a bigger read buffer
+static const int GROW_AFTER_FULL_READS = 2;
+// consecutive reads that would fit the smaller class before shrinking
+static const int SHRINK_AFTER_SMALL_READS = 8;
+// chat messages per room replayed to whoever joins it
+static const size_t DEFAULT_HISTORY_SIZE = 32;
+// how long a handoff waits for in-flight writes before leaving the
+// sessions that still have some behind
+static const uint64_t HANDOFF_DRAIN_MS = 2000;
+static const uint64_t DRAIN_CHECK_MS = 5;
+// time the goodbye broadcast gets before the loops stop
+static const uint64_t SHUTDOWN_GRACE_MS = 200;
 
-void Log(std::string str)
+// matches "/<command> <argument>" and returns the argument
+static bool ParseCommand(FrameView text, const char* command, std::string* argument)
 {
-    std::cout << str << std::endl;
+    size_t len = strlen(command);
+    if (text.size <= len + 1 || memcmp(text.data, command, len) != 0 || text.data[len] != ' ')
+    {
+        return false;
+    }
+
+    argument->assign(text.data + len + 1, text.size - len - 1);
+    // tolerate the trailing whitespace line-based clients send along
+    argument->erase(argument->find_last_not_of(" \t\r\n") + 1);
+    return true;
+}
+
+void ChatServer::OnAllocBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+{
+    ChatSession* s = static_cast<ChatSession*>(handle->data);
+    if (s->read_buf == nullptr)
+    {
+        // libuv's suggestion caps how far a bulk sender may grow
+        s->read_class = std::min<int>(s->read_class, ReadBufferPool::ClassFor(suggested_size));
+        s->read_buf = read_buffers.Acquire(s->read_class);
+    }
+    *buf = uv_buf_init(s->read_buf, ReadBufferPool::ClassSize(s->read_class));
+}
+
+void ChatServer::AdaptReadBuffer(ChatSession* s, size_t nread)
+{
+    size_t capacity = ReadBufferPool::ClassSize(s->read_class);
+    if (nread == capacity)
+    {
+        s->small_reads = 0;
+        if (++s->full_reads >= GROW_AFTER_FULL_READS && s->read_class + 1 < ReadBufferPool::CLASS_COUNT)
+        {
+            s->full_reads = 0;
+            ReleaseReadBuffer(s);
+            s->read_class++;
+        }
+        // a full read means more data is waiting, keep the buffer
+        return;
+    }
+
+    s->full_reads = 0;
+    if (s->read_class > 0 && nread <= ReadBufferPool::ClassSize(s->read_class - 1))
+    {
+        if (++s->small_reads >= SHRINK_AFTER_SMALL_READS)
+        {
+            s->small_reads = 0;
+            s->read_class--;
+        }
+    }
+    else
+    {
+        s->small_reads = 0;
+    }
+
+    // the socket is drained: frames were consumed in place and partial
+    // tails copied out, so an idle session holds no read memory
+    ReleaseReadBuffer(s);
+    if (!s->details->framer.HasPartial())
+    {
+        // nor what the last frame cut in two left behind
+        s->details->framer.Release();
+    }
 }
 
-void alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+void ChatServer::ReleaseReadBuffer(ChatSession* s)
 {
-    
-    ChatServer* server = ChatServer::GetInstance();
-    msg_buffer* readVector = server->GetReadBuffer();
-    *buf = uv_buf_init(readVector->data(), readVector->capacity());  
+    if (s->read_buf != nullptr)
+    {
+        read_buffers.Release(s->read_buf, s->read_class);
+        s->read_buf = nullptr;
+    }
 }
 
 void ChatServer::OnMsgRecv(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
 {
-    Log("Msg received!");
-    auto connection_pos = open_sessions.find(stream);
-    if (connection_pos != open_sessions.end())
+    LOG_DEBUG("Msg received!");
+    read_started = uv_hrtime();
+    ChatSession* s = static_cast<ChatSession*>(stream->data);
+    if (s != nullptr)
     {
+        if (nread <= 0)
+        {
+            // nothing landed in the buffer; give it back now, not once the
+            // handle has closed, or a mass disconnect holds one per session
+            ReleaseReadBuffer(s);
+        }
+
         bool reset_timer = true;
         if (nread == UV_EOF)
         {
             reset_timer = false;
-            RemoveClient(stream, connection_pos->second.IsActive(), ChatServer::DisconnectionReason::ConnectionClosed);
-            Log("Client Disconnected");
+            RemoveClient(stream, s->IsActive(), ChatServer::DisconnectionReason::ConnectionClosed);
+            LOG_INFO("Client Disconnected");
         }
         else if (nread > 0)
         {
-            const char* charbuffer = buf->base;
-            int n = nread;
-
-            while (n > 0)
+            metrics->Add(Counter::BytesIn, nread);
+            if (s->protocol == WireProtocol::Unknown)
             {
-                const char* zero = (char*)memchr(charbuffer, 0, n);
-                if (zero == nullptr)
+                // the first byte of the connection picks the wire format
+                s->protocol = DetectProtocol(buf->base[0]);
+                if (s->protocol == WireProtocol::V2)
                 {
-                    connection_pos->second.AddToMsg(charbuffer, n);
-                    n = 0;
+                    s->details->framer.SetLengthPrefixed(MeasureFrame);
                 }
-                else
-                {
-                    ChatSession* s = &connection_pos->second;
-                    int bufflen = zero - charbuffer;
-                    s->AddToMsg(charbuffer, bufflen);
-                    if (s->GetReadState() == ChatSession::ReadState::NameRead)
-                    {
-                        s->FinishMessage();
-                        // Time to check for name!
-                        std::string new_name = s->GetName();
-                        auto name_pos = std::find(name_list.begin(), name_list.end(), new_name);
-                        if (name_pos != name_list.end())
-                        {
-                            // name already exists
-                            SendSingleMsg(stream, "Chosen name already exists!");
-                            RemoveClient(stream, false, ChatServer::DisconnectionReason::DuplicateName);
-                            n = 0;
-                        }
-                        else
-                        {
-                            s->Activate();
-                            name_list.push_back(s->GetName());
-                            Broadcast(s->GetName() + " has joined!"); 
-                        }
-                    }
-                    else
-                    {
-                        Broadcast(s->GetName() + ":" + s->GetMsg());
-                        s->FinishMessage();
-                    }
-                    charbuffer = zero + 1;
-                    n -= bufflen + 1;
-                }
-            } 
+            }
+
+            bool well_formed = s->details->framer.Feed(buf->base, nread, [this, s] (FrameView frame)
+                                              {
+                                                  if (s->IsActive() && !TakeSendToken(s))
+                                                  {
+                                                      return OnOverLimit(s);
+                                                  }
+                                                  if (s->protocol == WireProtocol::V2)
+                                                  {
+                                                      return OnBinaryFrame(s, frame);
+                                                  }
+                                                  return OnFrame(s, frame);
+                                              });
+
+            if (!well_formed)
+            {
+                LOG_WARNING("Malformed frame from '%s'", s->GetName().c_str());
+                RemoveClient(stream, s->IsActive(), ChatServer::DisconnectionReason::Error);
+            }
+            else if (!uv_is_closing((uv_handle_t*)stream))
+            {
+                AdaptReadBuffer(s, nread);
+            }
         }
         else if (nread < 0)
         {
-            Log("Error: " + std::to_string(nread));
+            LOG_ERROR("Error: %d", (int)nread);
         }
         else if (nread == 0)
         {
-            Log("Zero msg size received");
+            LOG_DEBUG("Zero msg size received");
             // nothing bad is happening, but consider logging it
         }
 
-        if (reset_timer)
+        if (reset_timer && s->IsActive())
         {
-            uv_timer_start(connection_pos->second.activity_timer.get(), 
-                           [] (uv_timer_t* handle)
-                           {
-                               ChatServer::GetInstance()->OnClientTimeout(handle);
-                           },
-                           DISCONNECTION_TIME,
-                           0);
-               
+            // the wheel entry is left alone, expiry re-checks this timestamp;
+            // a connection still owing its name keeps its deadline
+            s->last_activity = uv_now(&loop);
         }
     }
     else
     {
         uv_read_stop(stream);
-        Log("Unrecognized client. Disconnecting.");
+        LOG_WARNING("Unrecognized client. Disconnecting.");
+    }
+}
+
+bool ChatServer::OnFrame(ChatSession* s, FrameView frame)
+{
+    if (s->GetReadState() == ChatSession::ReadState::NameRead)
+    {
+        return OnName(s, frame);
+    }
+    return OnChat(s, frame);
+}
+
+bool ChatServer::Announces(int room) const
+{
+    return presence_limit == 0 || rooms.Members(room).size() <= presence_limit;
+}
+
+bool ChatServer::TakeSendToken(ChatSession* s)
+{
+    if (send_limits.rate <= 0)
+    {
+        return true;
+    }
+
+    uint32_t now = (uint32_t)uv_now(&loop);
+    float tokens = std::min<double>(send_limits.burst,
+                                    s->send_tokens + (uint32_t)(now - s->send_updated_ms) * send_limits.rate / 1000.0);
+    s->send_updated_ms = now;
+    if (tokens >= send_limits.burst)
+    {
+        // the sender backed off, past drops are forgiven
+        s->send_strikes = 0;
+    }
+    if (tokens < 1)
+    {
+        s->send_tokens = tokens;
+        return false;
+    }
+    s->send_tokens = tokens - 1;
+    return true;
+}
+
+bool ChatServer::OnOverLimit(ChatSession* s)
+{
+    metrics->Add(Counter::MessagesRateLimited);
+    s->send_strikes++;
+    if (send_limits.max_drops != 0 && s->send_strikes > send_limits.max_drops)
+    {
+        LOG_WARNING("Disconnecting '%s' for flooding", s->GetName().c_str());
+        metrics->Add(Counter::Flooders);
+        RemoveClient(s->GetStream(), true, ChatServer::DisconnectionReason::Flooding);
+        return false;
+    }
+
+    if (s->send_strikes == 1)
+    {
+        // once per episode, not per dropped frame
+        SendSingleMsg(s->GetStream(), "Sending too fast, messages are dropped", FrameType::Error);
+    }
+    return true;
+}
+
+bool ChatServer::OnBinaryFrame(ChatSession* s, FrameView frame)
+{
+    FrameHeader header;
+    FrameView payload;
+    if (!DecodeFrame(frame, &header, &payload))
+    {
+        return false;
+    }
+
+    bool naming = s->GetReadState() == ChatSession::ReadState::NameRead;
+    if (header.type == FrameType::Hello && naming)
+    {
+        HelloPayload hello;
+        if (!DecodeHello(payload, &hello) || hello.version != PROTOCOL_VERSION)
+        {
+            SendSingleMsg(s->GetStream(), "Unsupported protocol version", FrameType::Error);
+            RemoveClient(s->GetStream(), false, ChatServer::DisconnectionReason::Error);
+            return false;
+        }
+
+        s->capabilities = hello.capabilities & SERVER_CAPABILITIES;
+        return OnName(s, hello.name);
+    }
+    else if (header.type == FrameType::Chat && !naming && (header.flags & FRAME_FLAG_COMPRESSED) == 0)
+    {
+        // compression is one way: clients send plain text
+        return OnChat(s, payload);
+    }
+
+    SendSingleMsg(s->GetStream(), "Unexpected frame", FrameType::Error);
+    return true;
+}
+
+bool ChatServer::OnName(ChatSession* s, FrameView name)
+{
+    // out of the name phase, whether or not the name is taken
+    pending_sessions--;
+    metrics->Adjust(Gauge::PendingSessions, -1);
+    s->SetName(name);
+    // Time to check for name!
+    bool name_taken;
+    {
+        std::lock_guard<std::mutex> names_guard(group->names_lock);
+        NameOwner owner{shard_id, open_sessions.MakeRef(s)};
+        name_taken = group->names.Insert(s->GetName(), owner) == false;
+        group->named_sessions = group->names.Size();
+    }
+
+    if (name_taken)
+    {
+        // name already exists
+        SendSingleMsg(s->GetStream(), "Chosen name already exists!", FrameType::Error);
+        RemoveClient(s->GetStream(), false, ChatServer::DisconnectionReason::DuplicateName);
+        return false;
+    }
+
+    if (s->protocol == WireProtocol::V2)
+    {
+        // acknowledge the handshake with the capabilities we agreed on
+        Msg* hello = EncodeHello(messages, s->capabilities, s->GetName());
+        SendData(s->GetStream(), hello);
+        hello->Release();
+    }
+
+    s->Activate();
+    s->send_tokens = send_limits.burst;
+    s->send_updated_ms = (uint32_t)uv_now(&loop);
+    rooms.Join(LOBBY_ROOM, s);
+    s->current_room = LOBBY_ROOM;
+    SendHistory(s, LOBBY_ROOM);
+    if (Announces(LOBBY_ROOM))
+    {
+        Broadcast(s->GetName() + " has joined!");
+    }
+    return true;
+}
+
+bool ChatServer::OnChat(ChatSession* s, FrameView text)
+{
+    uint64_t frame_done = trace != nullptr ? uv_hrtime() : 0;
+    std::string argument;
+    if (ParseCommand(text, "/join", &argument))
+    {
+        OnJoin(s, argument);
+        return true;
+    }
+    if (ParseCommand(text, "/leave", &argument))
+    {
+        OnLeave(s, argument);
+        return true;
+    }
+    if (ParseCommand(text, "/msg", &argument))
+    {
+        OnDirectMessage(s, argument);
+        return true;
+    }
+
+    // "[#room ]name:message" is composed straight into a pooled payload,
+    // wire encodings are derived from it on demand
+    const std::string& name = s->GetName();
+    const std::string& room = rooms.Name(s->current_room);
+    size_t prefix = s->current_room != LOBBY_ROOM ? room.size() + 2 : 0;
+    if (prefix + name.size() + 1 + text.size > MAX_FRAME_PAYLOAD)
+    {
+        // v2 members would take the frame for a malformed stream
+        SendSingleMsg(s->GetStream(), "Message too long", FrameType::Error);
+        return true;
+    }
+    Msg* composed = messages.Allocate(prefix + name.size() + 1 + text.size + 1);
+    char* out = composed->Data();
+    if (prefix != 0)
+    {
+        *out++ = '#';
+        memcpy(out, room.data(), room.size());
+        out += room.size();
+        *out++ = ' ';
+    }
+    memcpy(out, name.data(), name.size());
+    out += name.size();
+    *out++ = ':';
+    memcpy(out, text.data, text.size);
+    out[text.size] = 0;
+
+    if (trace != nullptr)
+    {
+        trace_id = trace->Sample();
+        if (trace_id != 0)
+        {
+            trace->Record(TracePoint::Read, trace_id, read_started);
+            trace->Record(TracePoint::Frame, trace_id, frame_done);
+        }
+    }
+
+    Outbound message(&messages, FrameType::Chat, s->id, NextSequence());
+    message.AdoptText(composed);
+    metrics->Add(Counter::MessagesIn);
+    Broadcast(message, s->current_room);
+    metrics->Record(Histogram::RecvToBroadcast, uv_hrtime() - read_started);
+    trace_id = 0;
+    return true;
+}
+
+void ChatServer::OnJoin(ChatSession* s, const std::string& room_name)
+{
+    std::string name;
+    if (!RoomTable::Normalize(room_name, &name))
+    {
+        SendSingleMsg(s->GetStream(), "Invalid room name", FrameType::Error);
+        return;
+    }
+
+    int room = rooms.Find(name);
+    if (room >= 0 && (s->room_bits & ((uint64_t)1 << room)) != 0)
+    {
+        s->current_room = room;
+        SendSingleMsg(s->GetStream(), "Now talking in #" + name);
+        return;
+    }
+
+    if (s->seat_count == MAX_JOINED_ROOMS)
+    {
+        SendSingleMsg(s->GetStream(), "You are in too many rooms", FrameType::Error);
+        return;
+    }
+
+    room = rooms.Open(name);
+    if (room < 0)
+    {
+        SendSingleMsg(s->GetStream(), "No more rooms available", FrameType::Error);
+        return;
+    }
+
+    rooms.Join(room, s);
+    s->current_room = room;
+    SendHistory(s, room);
+    if (Announces(room))
+    {
+        Broadcast(s->GetName() + " has joined #" + name, room);
+    }
+}
+
+void ChatServer::OnDirectMessage(ChatSession* s, const std::string& argument)
+{
+    size_t split = argument.find(' ');
+    if (split == std::string::npos)
+    {
+        SendSingleMsg(s->GetStream(), "Usage: /msg <name> <message>", FrameType::Error);
+        return;
+    }
+
+    std::string target = argument.substr(0, split);
+    NameOwner owner;
+    bool found;
+    {
+        std::lock_guard<std::mutex> names_guard(group->names_lock);
+        found = group->names.Find(target, &owner);
+    }
+
+    if (!found)
+    {
+        // answered right here, nobody else hears about it
+        SendSingleMsg(s->GetStream(), "No such user: " + target, FrameType::Error);
+        return;
+    }
+
+    std::string message = "(dm) " + s->GetName() + ":" + argument.substr(split + 1);
+    if (message.size() > MAX_FRAME_PAYLOAD)
+    {
+        SendSingleMsg(s->GetStream(), "Message too long", FrameType::Error);
+        return;
+    }
+    SendToSession(owner, message, FrameType::Chat);
+}
+
+void ChatServer::OnLeave(ChatSession* s, const std::string& room_name)
+{
+    std::string name;
+    int room = RoomTable::Normalize(room_name, &name) ? rooms.Find(name) : -1;
+    if (room < 0 || (s->room_bits & ((uint64_t)1 << room)) == 0)
+    {
+        SendSingleMsg(s->GetStream(), "You are not in #" + room_name, FrameType::Error);
+        return;
+    }
+
+    if (s->seat_count == 1)
+    {
+        SendSingleMsg(s->GetStream(), "You can't leave your only room", FrameType::Error);
+        return;
+    }
+
+    // announce first, the room is recycled once its last member is gone
+    if (Announces(room))
+    {
+        Broadcast(s->GetName() + " has left #" + name, room);
+    }
+    rooms.Leave(room, s);
+
+    if (s->current_room == room)
+    {
+        s->current_room = s->details->seats[0].room;
+        SendSingleMsg(s->GetStream(), "Now talking in #" + rooms.Name(s->current_room));
     }
 }
 
 void ChatServer::RemoveClient(uv_stream_t* client, bool remove_name_from_list, DisconnectionReason reason)
 {
-    auto connection_pos = open_sessions.find(client);
-    if (connection_pos != open_sessions.end())
+    ChatSession* session = static_cast<ChatSession*>(client->data);
+    if (session != nullptr && !uv_is_closing((uv_handle_t*)client))
     {   
         std::string reasonstr = "Connection Closed";
         if (reason == DisconnectionReason::Timeout)
@@ -124,6 +506,14 @@ void ChatServer::RemoveClient(uv_stream_t* client, bool remove_name_from_list, D
         {
             reasonstr = "Name already taken";
         }
+        else if (reason == DisconnectionReason::SlowConsumer)
+        {
+            reasonstr = "Too slow to keep up";
+        }
+        else if (reason == DisconnectionReason::Flooding)
+        {
+            reasonstr = "Sending too fast";
+        }
         else if (reason == DisconnectionReason::Error)
         {
             reasonstr = "Server Error";
@@ -132,9 +522,11 @@ void ChatServer::RemoveClient(uv_stream_t* client, bool remove_name_from_list, D
         std::string name;
         if (remove_name_from_list)
         {
-            name = connection_pos->second.GetName();
-            Log("Removing name '" + name + "' from list");
-            name_list.erase(std::remove(name_list.begin(), name_list.end(), name), name_list.end());
+            name = session->GetName();
+            LOG_INFO("Removing name '%s' from list", name.c_str());
+            std::lock_guard<std::mutex> names_guard(group->names_lock);
+            group->names.Remove(name);
+            group->named_sessions = group->names.Size();
         }
 
 
@@ -143,264 +535,1377 @@ void ChatServer::RemoveClient(uv_stream_t* client, bool remove_name_from_list, D
             SendSingleMsg(client, "You have been disconnected(" + reasonstr + ")");
         }
       
-        uv_timer_stop(connection_pos->second.activity_timer.get());
-        active_timers.erase(connection_pos->second.activity_timer.get());
+        timers.Cancel(&session->idle_timer);
         uv_read_stop(client);
         
-        connection_pos->second.Deactivate();
+        rooms.LeaveAll(session);
+        session->Deactivate();
 
-        if (remove_name_from_list)
+        if (remove_name_from_list && Announces(LOBBY_ROOM))
         {
             Broadcast(name + " has left the chat(" + reasonstr + ")");
         }
 
-        uv_close((uv_handle_t*)connection_pos->second.connection.get(), 
-                 [] (uv_handle_t* handle)
-                 {
-                     ChatServer::GetInstance()->OnConnectionClose(handle);
-                 });
+        CloseSession(session);
     }
 }
 
-void ChatServer::OnConnectionClose(uv_handle_t* handle)
+void ChatServer::CloseSession(ChatSession* session)
 {
-    open_sessions.erase((uv_stream_t*)handle);
+    auto on_close = [] (uv_handle_t* handle)
+                    {
+                        ChatServer::FromLoop(handle->loop)->OnConnectionClose(handle);
+                    };
+
+    uv_close((uv_handle_t*)&session->connection, on_close);
 }
 
-void ChatServer::Broadcast(const std::string& msg)
+void ChatServer::OnConnectionClose(uv_handle_t* handle)
 {
-    Log("Broadcasting message: " + msg + std::to_string(msg.size()));    
-    if (name_list.size() > 0)
+    ChatSession* session = static_cast<ChatSession*>(handle->data);
+    ReleaseReadBuffer(session);
+    if (session->GetReadState() == ChatSession::ReadState::NameRead)
     {
-        std::shared_ptr<Msg> msgStruct = std::make_shared<Msg>(msg);
-        for (auto& session : open_sessions)
-        {
-            if (session.second.IsActive())
-            {
-                msg_queue.messages.push(msgStruct);
-                SendData((uv_stream_t*)session.second.connection.get(), msg_queue.messages.back().get());
-            }
-        }  
+        pending_sessions--;
+        metrics->Adjust(Gauge::PendingSessions, -1);
     }
-    else
+
+    // in-flight writes were cancelled before this callback, drop the backlog
+    while (session->backlog_head != nullptr)
     {
-        //Not sending message to anyone as noone is fully connected yet
+        WriteReq* req = session->backlog_head;
+        session->backlog_head = req->next;
+        metrics->Adjust(Gauge::BacklogMessages, -1);
+        FinishWrite(req);
     }
+    open_sessions.Release(session);
+    metrics->Add(Counter::ConnectionsClosed);
+    metrics->Adjust(Gauge::Sessions, -1);
 }
 
-void ChatServer::SendSingleMsg(uv_stream_t* target, std::string message)
+void ChatServer::Broadcast(const std::string& msg, int room)
 {
-    std::shared_ptr<Msg> new_msg = std::make_shared<Msg>(Msg(message));
-    msg_queue.messages.push(new_msg);
-    Log("Sending message: " + message +"[" + std::to_string(message.size()) + "]");
-   
-    SendData(target, msg_queue.messages.back().get());
+    Outbound message(&messages, FrameType::System, 0, NextSequence());
+    message.SetText(msg.data(), msg.size());
+    Broadcast(message, room);
 }
 
-void ChatServer::SendData(uv_stream_t* connection, Msg* message)
+void ChatServer::Broadcast(Outbound& message, int room)
 {
-    uv_write_t* req = msg_queue.requests.GetNew();
-    uv_write(req,
-             connection,
-             message->GetBuf(),
-             1,
-             [] (uv_write_t* req, int status)
-             {
-                 ChatServer::GetInstance()->OnMsgSent(req, status);
-             });
-}
+    LOG_DEBUG("Broadcasting message: %s [%zu]", message.Text(), message.TextSize());
+    bool has_clients = group->named_sessions != 0;
 
-void ChatServer::OnClientTimeout(uv_timer_t* handle)
-{
-    auto pos = active_timers.find(handle);
-    if (pos != active_timers.end())
+    metrics->Add(Counter::Broadcasts);
+    if (message.Type() == FrameType::Chat)
+    {
+        // logged once, by the shard the message came in on
+        message_log.Append(message.Type(), message.Sender(), message.Sequence(),
+                           rooms.Name(room), message.Text(), message.TextSize());
+    }
+
+    if (has_clients)
     {
-        auto session_pos = open_sessions.find(pos->second);
-        if (session_pos != open_sessions.end())
+        BroadcastLocal(message, room);
+        if (group->shards.size() > 1)
         {
-            ChatSession* s = &(session_pos->second);
-            RemoveClient((uv_stream_t*)s->connection.get(),
-                         s->IsActive(),
-                         ChatServer::DisconnectionReason::Timeout);
+            // Msgs are loop-local, the other shards share one pooled copy
+            // and rebuild the message from it
+            Relayed* relayed = group->relays.Create(rooms.Name(room), message.Text(), message.TextSize(),
+                                                    message.Type(), message.Sender(), message.Sequence(),
+                                                    trace_id, group->shards.size() - 1);
+            for (ChatServer* shard : group->shards)
+            {
+                if (shard != this)
+                {
+                    shard->Relay(relayed);
+                }
+            }
         }
     }
     else
     {
-        Log("Session timeout timer activated, but client already left");
+        //Not sending message to anyone as noone is fully connected yet
     }
 }
 
-void ChatServer::OnNewConnection(uv_stream_t* server, int status)
+void ChatServer::BroadcastLocal(Outbound& message, int room)
 {
-    Log("New Connection Attempt");
-    if (status == 0)
-    {
-        ChatSession newSession; 
-        newSession.connection = std::make_shared<uv_tcp_t>();
-        newSession.activity_timer = std::make_shared<uv_timer_t>();
-         
-        uv_tcp_init(&loop, newSession.connection.get());
-        uv_timer_init(&loop, newSession.activity_timer.get());
-       
-        Log("Trying to accept connection");
-        if (uv_accept(server, (uv_stream_t*)newSession.connection.get()) == 0)
-        {
-            Log("Connection accepted!");
-            uv_stream_t* key = (uv_stream_t*)newSession.connection.get();
-            uv_read_start((uv_stream_t*)newSession.connection.get(),
-                          alloc_buffer, 
-                          [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
-            {
-                ChatServer::GetInstance()->OnMsgRecv(stream, nread, buf);
-            });
-
-            open_sessions.insert({key, 
-                                newSession});
-            active_timers.insert({newSession.activity_timer.get(), key});
-            
-            uv_timer_start(newSession.activity_timer.get(), 
-                           [] (uv_timer_t* handle)
-                           {
-                               ChatServer::GetInstance()->OnClientTimeout(handle);
-                           },
-                           DISCONNECTION_TIME,
-                           0);
-           
+    // one payload per wire format, every write holds a reference to it;
+    // members are active sessions only, they leave before deactivating
+    const std::vector<ChatSession*>& members = rooms.Members(room);
+    FanOut(message, members, [this] (ChatSession* session, Msg* payload)
+                             {
+                                 SendData(session->GetStream(), payload);
+                             });
 
-            Log("Session saved!");
-        }
-        else
-        {
-            Log("Error accepting connection" + std::string(uv_strerror(status)));
-            uv_read_stop((uv_stream_t*)newSession.connection.get());
-        }
-    }
-    else
+    if (message.Type() == FrameType::Chat)
     {
-       Log("Connection error: " +  std::string(uv_strerror(status)));
+        // recorded once the members' encodings exist so replays share them;
+        // notices about people coming and going are not worth replaying
+        rooms.History(room).Record(message);
     }
 
+    if (trace_id != 0)
+    {
+        trace->Record(TracePoint::Broadcast, trace_id, uv_hrtime(), members.size());
+    }
 }
 
-ChatServer* ChatServer::GetInstance()
+void ChatServer::SendHistory(ChatSession* session, int room)
 {
-    static ChatServer server;
-    return &server;
+    replay.clear();
+    rooms.History(room).Collect(session->protocol, session->capabilities, &replay);
+    if (!replay.empty())
+    {
+        // the whole backlog leaves as one gathered write
+        QueueWrite(session, writes.Acquire(replay.data(), replay.size()));
+    }
 }
 
-const size_t MAX_BUFF_SIZE = 4096;
-ChatServer::ChatServer()
-    : running(false)
+uint64_t ChatServer::NextSequence()
 {
-    read_buffer.resize(MAX_BUFF_SIZE);
+    return group->next_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
 }
 
-int ChatServer::Init(int port)
+void ChatServer::Post(shard_task_t task)
 {
-    uv_loop_init(&loop);
-    uv_tcp_init(&loop, &server);
-
-    sockaddr_in addr;
-    uv_ip4_addr("0.0.0.0", port, &addr);
-
-    uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
-
-    int err = uv_listen((uv_stream_t*) &server, 
-                        DEFAULT_BACKLOG, 
-                        [](uv_stream_t* server, int status)
-                        {
-                            ChatServer::GetInstance()->OnNewConnection(server, status);
-                        });
-
-    if (err == 0)
     {
-        std::cout << "Listening for connections on port " << port << std::endl;
-        uv_run(&loop, UV_RUN_DEFAULT);
-        running = true;
+        std::lock_guard<std::mutex> inbox_guard(inbox_lock);
+        inbox.push_back(std::move(task));
     }
-
-    return err;   
+    uv_async_send(&inbox_async);
 }
 
-msg_buffer* ChatServer::GetReadBuffer()
+void ChatServer::Relay(Relayed* relayed)
 {
-    return &read_buffer;
+    {
+        std::lock_guard<std::mutex> inbox_guard(inbox_lock);
+        relay_inbox.push_back(relayed);
+    }
+    uv_async_send(&inbox_async);
 }
 
-ChatServer::~ChatServer()
+void ChatServer::OnRelayed(Relayed* relayed)
 {
-    uv_loop_close(&loop);
-    std::cout << "Server Terminated";
+    room_scratch.assign(relayed->Room(), relayed->RoomSize());
+    int room = rooms.Find(room_scratch);
+    if (room >= 0)
+    {
+        Outbound local(&messages, relayed->Type(), relayed->Sender(), relayed->Sequence());
+        local.SetText(relayed->Text(), relayed->TextSize());
+        trace_id = relayed->TraceId();
+        BroadcastLocal(local, room);
+        trace_id = 0;
+    }
+    relayed->Release();
 }
 
-ChatSession::ChatSession()
-    : state(ReadState::NameRead)
-    , active(false)
+void ChatServer::OnInbox()
 {
-}
+    std::vector<shard_task_t> tasks;
+    {
+        std::lock_guard<std::mutex> inbox_guard(inbox_lock);
+        tasks.swap(inbox);
+        relays_taken.swap(relay_inbox);
+    }
 
-void ChatSession::AddToMsg(const char* msg_part, size_t size)
-{
-    next_msg.append(msg_part, size);
-}
+    for (Relayed* relayed : relays_taken)
+    {
+        OnRelayed(relayed);
+    }
+    relays_taken.clear();
 
-ChatSession::~ChatSession()
-{
+    for (auto& task : tasks)
+    {
+        task(this);
+    }
 }
 
-std::string ChatSession::GetName() const
+void ChatServer::SendSingleMsg(uv_stream_t* target, std::string message, FrameType type)
 {
-    return name;
-}
+    LOG_DEBUG("Sending message: %s [%zu]", message.c_str(), message.size());
 
-std::string ChatSession::GetMsg() const
-{
-    return next_msg;
-}
+    ChatSession* session = static_cast<ChatSession*>(target->data);
+    WireProtocol protocol = session->protocol == WireProtocol::V2 ? WireProtocol::V2 : WireProtocol::Legacy;
 
-void ChatSession::FinishMessage()
-{
-    if (state == ReadState::NameRead)
-    {
-        name = std::string(next_msg.begin(), next_msg.end());
-        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
-        state = ReadState::MessageRead;
-    }
-    next_msg.clear();
+    Outbound single(&messages, type, 0, 0);
+    single.SetText(message.data(), message.size());
+    SendData(target, single.Encode(protocol, session->capabilities));
 }
 
-void ChatServer::OnMsgSent(uv_write_t* req, int status)
+void ChatServer::SendToSession(NameOwner owner, const std::string& message, FrameType type)
 {
-    if (msg_queue.messages.empty() == false)
+    if (owner.shard != shard_id)
     {
-        msg_queue.messages.pop();
-        msg_queue.requests.Release();
+        group->shards[owner.shard]->Post([owner, message, type] (ChatServer* target)
+                                         {
+                                             target->SendToSession(owner, message, type);
+                                         });
+        return;
     }
 
-
-    if (status != 0)
+    // the reference goes stale if the session left in the meantime
+    ChatSession* session = open_sessions.Find(owner.session);
+    if (session != nullptr && session->IsActive())
     {
-        Log("Error sending message! " + std::string(uv_strerror(status)));
+        SendSingleMsg(session->GetStream(), message, type);
     }
 }
 
-ChatSession::ReadState ChatSession::GetReadState() const
+void ChatServer::SendData(uv_stream_t* connection, Msg* message)
 {
-    return state;
+    QueueWrite(static_cast<ChatSession*>(connection->data), writes.Acquire(message));
 }
 
-void ChatSession::Activate()
+void ChatServer::QueueWrite(ChatSession* session, WriteReq* req)
 {
-    active = true;
-}
+    if (exported)
+    {
+        // the session belongs to the successor now
+        writes.Release(req);
+        return;
+    }
 
-void ChatSession::Deactivate()
+    size_t size = req->size;
+    req->queued_at = uv_hrtime();
+    req->trace_id = trace_id;
+
+    // a session with nothing in flight always gets one write, however big
+    if (session->backlog_head == nullptr
+        && (session->inflight_bytes == 0 || session->inflight_bytes + size <= limits.inflight_bytes))
+    {
+        group->outbound_bytes += size;
+        metrics->Adjust(Gauge::OutboundBytes, size);
+        SubmitWrite(session, req);
+        return;
+    }
+
+    bool over_budget = session->backlog_bytes + size > limits.backlog_bytes
+                    || session->backlog_msgs + 1 > limits.backlog_msgs
+                    || group->outbound_bytes + size > limits.total_bytes;
+    if (over_budget)
+    {
+        if (limits.policy == SlowConsumerPolicy::DropNewest)
+        {
+            metrics->Add(Counter::WritesDropped);
+            writes.Release(req);
+            return;
+        }
+
+        if (limits.policy == SlowConsumerPolicy::Disconnect)
+        {
+            metrics->Add(Counter::WritesDropped);
+            writes.Release(req);
+            if (!session->disconnect_pending)
+            {
+                // not from here: we may be in the middle of a broadcast
+                session->disconnect_pending = true;
+                slow_consumers.push_back(open_sessions.MakeRef(session));
+                uv_check_start(&deferred_check, [] (uv_check_t* handle)
+                                                {
+                                                    ChatServer::FromLoop(handle->loop)->OnDeferredWork();
+                                                });
+            }
+            return;
+        }
+    }
+
+    group->outbound_bytes += size;
+    metrics->Adjust(Gauge::OutboundBytes, size);
+    metrics->Adjust(Gauge::BacklogMessages, 1);
+    if (session->backlog_tail != nullptr)
+    {
+        session->backlog_tail->next = req;
+    }
+    else
+    {
+        session->backlog_head = req;
+    }
+    session->backlog_tail = req;
+    session->backlog_bytes += size;
+    session->backlog_msgs++;
+
+    if (over_budget)
+    {
+        // DropOldest: make room by discarding what has waited longest
+        while (session->backlog_head != req
+               && (session->backlog_bytes > limits.backlog_bytes
+                   || session->backlog_msgs > limits.backlog_msgs
+                   || group->outbound_bytes > limits.total_bytes))
+        {
+            WriteReq* oldest = session->backlog_head;
+            session->backlog_head = oldest->next;
+            session->backlog_bytes -= oldest->size;
+            session->backlog_msgs--;
+            metrics->Adjust(Gauge::BacklogMessages, -1);
+            metrics->Add(Counter::WritesDropped);
+            FinishWrite(oldest);
+        }
+    }
+}
+
+void ChatServer::SubmitWrite(ChatSession* session, WriteReq* req)
+{
+    session->inflight_bytes += req->size;
+    metrics->Adjust(Gauge::WritesInFlight, 1);
+
+    const uv_buf_t* bufs = req->payload->GetBuf();
+    unsigned int nbufs = 1;
+    if (!req->gathered.empty())
+    {
+        // libuv copies the buffer list, the scratch vector is reusable
+        gather_bufs.clear();
+        gather_bufs.push_back(*req->payload->GetBuf());
+        for (Msg* payload : req->gathered)
+        {
+            gather_bufs.push_back(*payload->GetBuf());
+        }
+        bufs = gather_bufs.data();
+        nbufs = gather_bufs.size();
+    }
+
+    uv_write(&req->request,
+             session->GetStream(),
+             bufs,
+             nbufs,
+             [] (uv_write_t* req, int status)
+             {
+                 ChatServer::FromLoop(req->handle->loop)->OnMsgSent(req, status);
+             });
+}
+
+void ChatServer::FlushBacklog(ChatSession* session)
+{
+    while (session->backlog_head != nullptr)
+    {
+        WriteReq* req = session->backlog_head;
+        size_t size = req->size;
+        if (session->inflight_bytes != 0 && session->inflight_bytes + size > limits.inflight_bytes)
+        {
+            break;
+        }
+
+        session->backlog_head = req->next;
+        if (session->backlog_head == nullptr)
+        {
+            session->backlog_tail = nullptr;
+        }
+        session->backlog_bytes -= size;
+        session->backlog_msgs--;
+        metrics->Adjust(Gauge::BacklogMessages, -1);
+        req->next = nullptr;
+        SubmitWrite(session, req);
+    }
+}
+
+void ChatServer::FinishWrite(WriteReq* req)
+{
+    group->outbound_bytes -= req->size;
+    metrics->Adjust(Gauge::OutboundBytes, -(int64_t)req->size);
+    writes.Release(req);
+}
+
+void ChatServer::OnDeferredWork()
+{
+    uv_check_stop(&deferred_check);
+
+    std::vector<SessionRef> pending;
+    pending.swap(slow_consumers);
+    for (SessionRef ref : pending)
+    {
+        ChatSession* s = open_sessions.Find(ref);
+        if (s != nullptr)
+        {
+            LOG_WARNING("Disconnecting slow consumer '%s'", s->GetName().c_str());
+            metrics->Add(Counter::SlowConsumers);
+            RemoveClient(s->GetStream(), s->IsActive(), ChatServer::DisconnectionReason::SlowConsumer);
+        }
+    }
+}
+
+void ChatServer::ScheduleTimeout(ChatSession* session)
+{
+    timers.Schedule(&session->idle_timer, (Deadline(session) + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS);
+}
+
+uint64_t ChatServer::Deadline(const ChatSession* session) const
+{
+    if (!session->IsActive())
+    {
+        // counted from the accept, a new connection has little time to name itself
+        return session->last_activity + admission.name_timeout_ms;
+    }
+    return session->last_activity + idle_timeout;
+}
+
+void ChatServer::OnTimerTick()
+{
+    uint64_t now = uv_now(&loop);
+    loop_lag = now > next_tick_due ? now - next_tick_due : 0;
+    next_tick_due = now + WHEEL_TICK_MS;
+    expired_timers.clear();
+    timers.Advance(now / WHEEL_TICK_MS, expired_timers);
+
+    for (WheelNode* node : expired_timers)
+    {
+        ChatSession* s = static_cast<ChatSession*>(node->data);
+        if (Deadline(s) > now)
+        {
+            // there was activity since the entry was scheduled
+            ScheduleTimeout(s);
+        }
+        else
+        {
+            OnClientTimeout(s);
+        }
+    }
+}
+
+void ChatServer::OnClientTimeout(ChatSession* s)
+{
+    if (!uv_is_closing((uv_handle_t*)s->GetStream()))
+    {
+        RemoveClient(s->GetStream(),
+                     s->IsActive(),
+                     ChatServer::DisconnectionReason::Timeout);
+    }
+    else
+    {
+        LOG_DEBUG("Session timeout timer activated, but client already left");
+    }
+}
+
+void ChatServer::OnNewConnection(uv_stream_t* server, int status)
+{
+    LOG_DEBUG("New Connection Attempt");
+    if (status != 0)
+    {
+       LOG_ERROR("Connection error: %s", uv_strerror(status));
+       return;
+    }
+
+    if (accepts_this_turn == 0)
+    {
+        uv_prepare_start(&accept_prepare,
+                         [] (uv_prepare_t* handle)
+                         {
+                             ChatServer::FromLoop(handle->loop)->OnAcceptTurn();
+                         });
+    }
+
+    if (accepts_this_turn >= admission.accept_batch || loop_lag > admission.max_accept_lag_ms)
+    {
+        // libuv holds on to the connection and stops polling the listener
+        // until it is accepted
+        accept_paused = true;
+        return;
+    }
+    AcceptConnection();
+}
+
+void ChatServer::OnAcceptTurn()
+{
+    accepts_this_turn = 0;
+    if (!accept_paused)
+    {
+        uv_prepare_stop(&accept_prepare);
+        return;
+    }
+
+    if (loop_lag <= admission.max_accept_lag_ms)
+    {
+        // before polling, so the listener is watched again right away
+        accept_paused = false;
+        AcceptConnection();
+    }
+}
+
+void ChatServer::AcceptConnection()
+{
+    accepts_this_turn++;
+    ChatSession* session = open_sessions.Acquire();
+    metrics->Adjust(Gauge::Sessions, 1);
+    // pending from here, closing the session ends that too
+    pending_sessions++;
+    metrics->Adjust(Gauge::PendingSessions, 1);
+
+    uv_tcp_init(&loop, &session->connection);
+    session->connection.data = session;
+    session->idle_timer.data = session;
+    session->id = (++session_counter << 8) | shard_id;
+
+    LOG_DEBUG("Trying to accept connection");
+    int err = uv_accept((uv_stream_t*)&server, session->GetStream());
+    if (err != 0)
+    {
+        LOG_ERROR("Error accepting connection %s", uv_strerror(err));
+        CloseSession(session);
+        return;
+    }
+
+    if (!Admit(session))
+    {
+        metrics->Add(Counter::ConnectionsRejected);
+        CloseSession(session);
+        return;
+    }
+
+    metrics->Add(Counter::ConnectionsAccepted);
+    LOG_DEBUG("Connection accepted!");
+    StartReading(session);
+
+    session->last_activity = uv_now(&loop);
+    ScheduleTimeout(session);
+}
+
+bool ChatServer::Admit(ChatSession* session)
+{
+    // every shard takes its share of the process-wide cap
+    if (admission.max_pending != 0 && pending_sessions * group->shards.size() > admission.max_pending)
+    {
+        LOG_DEBUG("Too many connections without a name, rejecting");
+        return false;
+    }
+
+    if (address_buckets.IsEnabled())
+    {
+        sockaddr_storage peer;
+        int size = sizeof(peer);
+        if (uv_tcp_getpeername(&session->connection, (sockaddr*)&peer, &size) == 0
+            && !address_buckets.Take((const sockaddr*)&peer, uv_now(&loop)))
+        {
+            LOG_DEBUG("Connection rate exceeded, rejecting");
+            return false;
+        }
+    }
+    return true;
+}
+
+void ChatServer::StartReading(ChatSession* session)
+{
+    uv_read_start(session->GetStream(),
+                  [] (uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+                  {
+                      ChatServer::FromLoop(handle->loop)->OnAllocBuffer(handle, suggested_size, buf);
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+    {
+        ChatServer::FromLoop(stream->loop)->OnMsgRecv(stream, nread, buf);
+    });
+}
+
+void ChatServer::OnSuccessor()
+{
+    int fd;
+    int err = HandoffAccept(handoff_listener, &fd);
+    if (err != 0)
+    {
+        if (err == UV_EACCES)
+        {
+            LOG_WARNING("Refused a handoff to a process of another user");
+        }
+        return;
+    }
+
+    if (successor >= 0)
+    {
+        // one handoff at a time
+        close(fd);
+        return;
+    }
+
+    LOG_INFO("Handing over to a new server process");
+    successor = fd;
+    handoff = HandoffState();
+    handoff.shards.resize(group->shards.size());
+    handoff.metrics_listener = metrics_endpoint.Detach();
+    frozen_shards = 0;
+    for (ChatServer* shard : group->shards)
+    {
+        shard->Post([] (ChatServer* target)
+                    {
+                        target->Freeze();
+                    });
+    }
+}
+
+void ChatServer::Freeze()
+{
+    frozen = true;
+
+    // closing the listener would drop a connection libuv holds for us
+    if (accept_paused)
+    {
+        accept_paused = false;
+        AcceptConnection();
+    }
+    uv_prepare_stop(&accept_prepare);
+    accepts_this_turn = 0;
+
+    // the successor accepts from here on, pending connections wait for it
+    // in the kernel's queue
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)&server, &fd);
+    frozen_listener = dup(fd);
+    uv_close((uv_handle_t*)&server, nullptr);
+
+    // unread bytes stay in the socket buffers for the successor
+    for (ChatSession* session : open_sessions.Live())
+    {
+        if (!uv_is_closing((uv_handle_t*)session->GetStream()))
+        {
+            uv_read_stop(session->GetStream());
+        }
+    }
+
+    drain_deadline = uv_now(&loop) + HANDOFF_DRAIN_MS;
+    uv_timer_start(&drain_timer,
+                   [] (uv_timer_t* handle)
+                   {
+                       ChatServer::FromLoop(handle->loop)->OnDrainTick();
+                   },
+                   0,
+                   DRAIN_CHECK_MS);
+}
+
+void ChatServer::OnDrainTick()
+{
+    if (writes.InFlight() != 0 && uv_now(&loop) < drain_deadline)
+    {
+        return;
+    }
+
+    uv_timer_stop(&drain_timer);
+    uv_timer_stop(&wheel_timer);
+    exported = true;
+
+    std::vector<SessionState> sessions;
+    for (ChatSession* session : open_sessions.Live())
+    {
+        if (uv_is_closing((uv_handle_t*)session->GetStream()))
+        {
+            continue;
+        }
+
+        if (session->inflight_bytes != 0 || session->backlog_head != nullptr)
+        {
+            // a frame may be cut in half, nobody else can continue this stream
+            LOG_WARNING("Not handing over '%s', its writes did not drain", session->GetName().c_str());
+            continue;
+        }
+        sessions.push_back(ExportSession(session));
+    }
+
+    ShardState state;
+    state.listener = frozen_listener;
+    state.session_counter = session_counter;
+    uint32_t shard = shard_id;
+    group->shards[0]->Post([shard, state, sessions] (ChatServer* coordinator)
+                           {
+                               coordinator->OnShardFrozen(shard, state, sessions);
+                           });
+}
+
+SessionState ChatServer::ExportSession(ChatSession* session)
+{
+    SessionState state;
+    state.shard = shard_id;
+    state.id = session->id;
+    state.protocol = session->protocol;
+    state.capabilities = session->capabilities;
+    state.named = session->IsActive();
+    state.name = session->GetName();
+    state.partial = session->details->framer.Partial();
+    for (int i = 0; i < session->seat_count; i++)
+    {
+        int room = session->details->seats[i].room;
+        if (room == session->current_room)
+        {
+            state.current_room = state.rooms.size();
+        }
+        state.rooms.push_back(rooms.Name(room));
+    }
+
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)&session->connection, &fd);
+    state.fd = fd;
+    return state;
+}
+
+void ChatServer::OnShardFrozen(uint32_t shard, ShardState state, const std::vector<SessionState>& sessions)
+{
+    handoff.shards[shard] = state;
+    handoff.sessions.insert(handoff.sessions.end(), sessions.begin(), sessions.end());
+    if (++frozen_shards < group->shards.size())
+    {
+        return;
+    }
+
+    // every loop is idle now, blocking this one for the transfer is fine
+    handoff.next_sequence = group->next_sequence;
+    int err = SendHandoff(successor, handoff);
+    if (err == 0)
+    {
+        err = WaitHandoffAck(successor);
+    }
+    close(successor);
+    successor = -1;
+
+    if (err != 0)
+    {
+        LOG_ERROR("Handoff failed, resuming service: %s", uv_strerror(err));
+        if (handoff.metrics_listener >= 0)
+        {
+            metrics_endpoint.Adopt(&loop, handoff.metrics_listener);
+        }
+        handoff = HandoffState();
+        for (ChatServer* target : group->shards)
+        {
+            target->Post([] (ChatServer* target)
+                         {
+                             target->Thaw();
+                         });
+        }
+        return;
+    }
+
+    // our copies of the sockets close on exit, the successor's stay open
+    LOG_INFO("Handed over %zu session(s), exiting", handoff.sessions.size());
+    Shutdown();
+}
+
+void ChatServer::Thaw()
+{
+    frozen = false;
+    exported = false;
+
+    uv_tcp_init(&loop, &server);
+    int err = uv_tcp_open(&server, frozen_listener);
+    if (err == 0)
+    {
+        err = StartListening();
+    }
+    if (err != 0)
+    {
+        LOG_ERROR("Cannot listen again after the failed handoff: %s", uv_strerror(err));
+    }
+    frozen_listener = -1;
+
+    for (ChatSession* session : open_sessions.Live())
+    {
+        if (!uv_is_closing((uv_handle_t*)session->GetStream()))
+        {
+            StartReading(session);
+        }
+    }
+    next_tick_due = uv_now(&loop) + WHEEL_TICK_MS;
+    uv_timer_again(&wheel_timer);
+}
+
+void ChatServer::RestoreSession(const SessionState& state)
+{
+    ChatSession* session = open_sessions.Acquire();
+    metrics->Adjust(Gauge::Sessions, 1);
+    pending_sessions++;
+    metrics->Adjust(Gauge::PendingSessions, 1);
+
+    uv_tcp_init(&loop, &session->connection);
+    session->connection.data = session;
+    session->idle_timer.data = session;
+    if (uv_tcp_open(&session->connection, state.fd) != 0)
+    {
+        close(state.fd);
+        CloseSession(session);
+        return;
+    }
+
+    session->id = state.id;
+    session->protocol = state.protocol;
+    session->capabilities = state.capabilities;
+    if (session->protocol == WireProtocol::V2)
+    {
+        session->details->framer.SetLengthPrefixed(MeasureFrame);
+    }
+    session->details->framer.SetPartial(state.partial);
+
+    if (state.named)
+    {
+        pending_sessions--;
+        metrics->Adjust(Gauge::PendingSessions, -1);
+        session->SetName(FrameView{state.name.data(), state.name.size()});
+        {
+            std::lock_guard<std::mutex> names_guard(group->names_lock);
+            group->names.Insert(session->GetName(), NameOwner{shard_id, open_sessions.MakeRef(session)});
+            group->named_sessions = group->names.Size();
+        }
+        session->Activate();
+        session->send_tokens = send_limits.burst;
+        session->send_updated_ms = (uint32_t)uv_now(&loop);
+
+        // rooms are joined quietly, nobody saw them leave
+        int current_room = -1;
+        for (size_t i = 0; i < state.rooms.size(); i++)
+        {
+            int room = rooms.Open(state.rooms[i]);
+            if (room >= 0 && rooms.Join(room, session) && i == state.current_room)
+            {
+                current_room = room;
+            }
+        }
+        if (session->seat_count == 0)
+        {
+            // none of its rooms could be opened here
+            rooms.Join(LOBBY_ROOM, session);
+        }
+        // talking in a room it isn't in would reach nobody
+        session->current_room = current_room >= 0 ? current_room : session->details->seats[0].room;
+    }
+
+    StartReading(session);
+    session->last_activity = uv_now(&loop);
+    ScheduleTimeout(session);
+}
+
+void ChatServer::OnTerminate()
 {
-    active = false;
+    for (uv_signal_t& handle : term_signals)
+    {
+        uv_signal_stop(&handle);
+    }
+
+    std::cout << "Terminating Server" << std::endl;
+    Broadcast("Server Terminating");
+    uv_timer_start(&shutdown_timer,
+                   [] (uv_timer_t* handle)
+                   {
+                       ChatServer::FromLoop(handle->loop)->Shutdown();
+                   },
+                   SHUTDOWN_GRACE_MS,
+                   0);
 }
 
-bool ChatSession::IsActive() const
+void ChatServer::Shutdown()
 {
-    return active;
+    for (ChatServer* shard : group->shards)
+    {
+        shard->Post([] (ChatServer* target)
+                    {
+                        target->Stop();
+                    });
+    }
+}
+
+void ChatServer::Stop()
+{
+    // uv_loop_close refuses a loop whose log sync is still out on the
+    // thread pool, so the loop stops once that job is back
+    message_log.Close([this] ()
+                      {
+                          uv_stop(&loop);
+                      });
+}
+
+void ChatServer::DumpTrace()
+{
+    if (trace_dumping)
+    {
+        // the last signal's dump is still being written
+        return;
+    }
+
+    // rendering every ring and writing the file would stall this shard
+    trace_dumping = true;
+    trace_dump.data = this;
+    uv_queue_work(&loop,
+                  &trace_dump,
+                  [] (uv_work_t* req)
+                  {
+                      static_cast<ChatServer*>(req->data)->trace_written = Tracer::GetInstance()->WriteFile();
+                  },
+                  [] (uv_work_t* req, int status)
+                  {
+                      ChatServer* server = static_cast<ChatServer*>(req->data);
+                      server->trace_dumping = false;
+                      if (status != 0 || !server->trace_written)
+                      {
+                          LOG_ERROR("Cannot write the trace file");
+                      }
+                  });
 }
 
+OutboundLimits::OutboundLimits()
+    : inflight_bytes(64 * 1024)
+    , backlog_bytes(1024 * 1024)
+    , backlog_msgs(4096)
+    , total_bytes((size_t)512 * 1024 * 1024)
+    , policy(SlowConsumerPolicy::DropOldest)
+{
+}
+
+SendLimits::SendLimits()
+    : rate(0)
+    , burst(0)
+    , max_drops(100)
+{
+}
+
+ChatServer* ChatServer::GetInstance()
+{
+    static ChatServer server;
+    return &server;
+}
+
+ChatServer* ChatServer::FromLoop(const uv_loop_t* loop)
+{
+    return static_cast<ChatServer*>(loop->data);
+}
+
+ChatServer::ChatServer()
+    : running(false)
+    , shard_id(0)
+    , session_counter(0)
+    , pending_sessions(0)
+    , accepts_this_turn(0)
+    , accept_paused(false)
+    , loop_lag(0)
+    , next_tick_due(0)
+    , connection_capacity(0)
+    , listen_backlog(DEFAULT_BACKLOG)
+    , presence_limit(0)
+    , idle_timeout(DISCONNECTION_TIME)
+    , history_size(DEFAULT_HISTORY_SIZE)
+    , metrics(nullptr)
+    , read_started(0)
+    , metrics_port(0)
+    , trace(nullptr)
+    , trace_id(0)
+    , trace_dumping(false)
+    , trace_written(false)
+    , handoff_listener(-1)
+    , successor(-1)
+    , frozen_shards(0)
+    , inherited_listener(-1)
+    , frozen(false)
+    , exported(false)
+    , frozen_listener(-1)
+    , drain_deadline(0)
+{
+}
+
+int ChatServer::Init(int port, int shard_count)
+{
+    int predecessor = -1;
+    if (!handoff_path.empty())
+    {
+        int err = HandoffConnect(handoff_path, &predecessor);
+        if (err == 0)
+        {
+            err = ReceiveHandoff(predecessor, &handoff);
+            if (err != 0)
+            {
+                close(predecessor);
+                return err;
+            }
+            // the inherited listening sockets decide how the port is shared
+            shard_count = handoff.shards.size();
+            std::cout << "Taking over " << handoff.sessions.size() << " session(s) from the running server" << std::endl;
+        }
+        else if (err != UV_ENOENT && err != UV_ECONNREFUSED)
+        {
+            return err;
+        }
+    }
+
+    group = std::make_shared<ShardGroup>();
+    group->shards.push_back(this);
+    group->names.Reserve(connection_capacity);
+
+    // extra shards live for the lifetime of the process
+    for (int i = 1; i < shard_count; i++)
+    {
+        ChatServer* shard = new ChatServer();
+        shard->group = group;
+        shard->shard_id = i;
+        shard->limits = limits;
+        shard->admission = admission;
+        shard->send_limits = send_limits;
+        shard->connection_capacity = connection_capacity;
+        shard->listen_backlog = listen_backlog;
+        shard->presence_limit = presence_limit;
+        shard->idle_timeout = idle_timeout;
+        shard->history_size = history_size;
+        shard->log_options = log_options;
+        group->shards.push_back(shard);
+    }
+
+    if (predecessor >= 0)
+    {
+        for (size_t i = 0; i < handoff.shards.size(); i++)
+        {
+            group->shards[i]->inherited_listener = handoff.shards[i].listener;
+            group->shards[i]->session_counter = handoff.shards[i].session_counter;
+        }
+    }
+
+    bool reuse_port = shard_count > 1;
+    for (ChatServer* shard : group->shards)
+    {
+        int err = shard->Listen(port, reuse_port);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    if (predecessor >= 0)
+    {
+        // no loop runs yet, every shard can be filled from here
+        for (const SessionState& state : handoff.sessions)
+        {
+            group->shards[state.shard]->RestoreSession(state);
+        }
+        group->next_sequence = handoff.next_sequence;
+
+        // once acknowledged the predecessor exits; without the ack it
+        // resumes serving, so we must not
+        int err = SendHandoffAck(predecessor);
+        close(predecessor);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    if (handoff.metrics_listener >= 0)
+    {
+        int err = metrics_endpoint.Adopt(&loop, handoff.metrics_listener);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+    else if (metrics_port != 0)
+    {
+        // scrapes are served by the first shard's loop
+        int err = metrics_endpoint.Listen(&loop, metrics_port);
+        if (err != 0)
+        {
+            return err;
+        }
+        std::cout << "Serving metrics on port " << metrics_port << std::endl;
+    }
+
+    if (trace != nullptr)
+    {
+        // the first shard takes the signal, the rings are copied live
+        uv_signal_init(&loop, &trace_signal);
+        uv_signal_start(&trace_signal,
+                        [] (uv_signal_t* handle, int signum)
+                        {
+                            ChatServer::FromLoop(handle->loop)->DumpTrace();
+                        },
+                        SIGUSR1);
+    }
+
+    // the goodbye is broadcast from the loop, not from a signal handler
+    int signals[] = { SIGINT, SIGTERM };
+    for (int i = 0; i < 2; i++)
+    {
+        uv_signal_init(&loop, &term_signals[i]);
+        uv_signal_start(&term_signals[i],
+                        [] (uv_signal_t* handle, int signum)
+                        {
+                            ChatServer::FromLoop(handle->loop)->OnTerminate();
+                        },
+                        signals[i]);
+    }
+    uv_timer_init(&loop, &shutdown_timer);
+
+    if (!handoff_path.empty())
+    {
+        int err = HandoffListen(handoff_path, &handoff_listener);
+        if (err != 0)
+        {
+            return err;
+        }
+        uv_poll_init(&loop, &handoff_poll, handoff_listener);
+        uv_poll_start(&handoff_poll,
+                      UV_READABLE,
+                      [] (uv_poll_t* handle, int status, int events)
+                      {
+                          ChatServer::FromLoop(handle->loop)->OnSuccessor();
+                      });
+    }
+    handoff = HandoffState();
+
+    std::cout << "Listening for connections on port " << port
+              << " (" << group->shards.size() << " shard(s))" << std::endl;
+
+    for (ChatServer* shard : group->shards)
+    {
+        if (shard != this)
+        {
+            shard->worker = std::thread([shard] ()
+                                        {
+                                            shard->Run();
+                                        });
+        }
+    }
+
+    Run();
+    for (ChatServer* shard : group->shards)
+    {
+        if (shard->worker.joinable())
+        {
+            shard->worker.join();
+        }
+    }
+    // with every loop stopped nothing posts across shards anymore
+    for (ChatServer* shard : group->shards)
+    {
+        shard->CloseHandles();
+    }
+    return 0;
+}
+
+void ChatServer::SetOutboundLimits(const OutboundLimits& limits)
+{
+    this->limits = limits;
+}
+
+void ChatServer::SetAdmissionLimits(const AdmissionLimits& limits)
+{
+    admission = limits;
+}
+
+void ChatServer::SetSendLimits(const SendLimits& limits)
+{
+    send_limits = limits;
+}
+
+void ChatServer::SetConnectionCapacity(size_t connections)
+{
+    connection_capacity = connections;
+}
+
+void ChatServer::SetListenBacklog(int backlog)
+{
+    listen_backlog = backlog;
+}
+
+void ChatServer::SetPresenceLimit(size_t members)
+{
+    presence_limit = members;
+}
+
+void ChatServer::SetIdleTimeout(uint64_t milliseconds)
+{
+    idle_timeout = milliseconds;
+}
+
+void ChatServer::SetHistorySize(size_t messages)
+{
+    history_size = messages;
+}
+
+void ChatServer::SetMessageLog(const MessageLogOptions& options)
+{
+    log_options = options;
+}
+
+void ChatServer::SetMetricsPort(int port)
+{
+    metrics_port = port;
+}
+
+void ChatServer::SetHandoffPath(const std::string& path)
+{
+    handoff_path = path;
+}
+
+int ChatServer::Listen(int port, bool reuse_port)
+{
+    uv_loop_init(&loop);
+    loop.data = this;
+    metrics = MetricsRegistry::GetInstance()->Register();
+    trace = Tracer::GetInstance()->Register(shard_id);
+    uv_tcp_init(&loop, &server);
+    uv_async_init(&loop, &inbox_async, [] (uv_async_t* handle)
+                                       {
+                                           ChatServer::FromLoop(handle->loop)->OnInbox();
+                                       });
+
+    // one loop timer drives every idle-disconnect deadline of this shard
+    timers.Start(uv_now(&loop) / WHEEL_TICK_MS);
+    uv_timer_init(&loop, &wheel_timer);
+    uv_timer_start(&wheel_timer,
+                   [] (uv_timer_t* handle)
+                   {
+                       ChatServer::FromLoop(handle->loop)->OnTimerTick();
+                   },
+                   WHEEL_TICK_MS,
+                   WHEEL_TICK_MS);
+    next_tick_due = uv_now(&loop) + WHEEL_TICK_MS;
+
+    uv_timer_init(&loop, &drain_timer);
+    uv_prepare_init(&loop, &accept_prepare);
+    // SO_REUSEPORT spreads an address's connections over all shards
+    size_t shard_count = group->shards.size();
+    address_buckets.Configure(admission.per_address_rate / shard_count,
+                              admission.per_address_burst / shard_count,
+                              ADDRESS_BUCKETS);
+
+    sockaddr_in addr;
+    uv_ip4_addr("0.0.0.0", port, &addr);
+
+    if (inherited_listener >= 0)
+    {
+        // already bound and listening, accepts carry on where they stopped
+        int err = uv_tcp_open(&server, inherited_listener);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+    else if (reuse_port)
+    {
+#ifdef SO_REUSEPORT
+        // every shard binds its own listening socket and lets the kernel
+        // spread incoming connections between them
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            return uv_translate_sys_error(errno);
+        }
+
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+        {
+            int err = uv_translate_sys_error(errno);
+            close(fd);
+            return err;
+        }
+
+        int err = uv_tcp_open(&server, fd);
+        if (err != 0)
+        {
+            close(fd);
+            return err;
+        }
+#else
+        return UV_ENOTSUP;
+#endif
+    }
+
+    uv_check_init(&loop, &deferred_check);
+    rooms.SetHistorySize(history_size);
+    if (connection_capacity != 0)
+    {
+        size_t share = connection_capacity / group->shards.size();
+        if (group->shards.size() > 1)
+        {
+            // SO_REUSEPORT hashes connections, shares come out a little uneven
+            share += share / 8;
+        }
+        open_sessions.Reserve(share);
+        rooms.ReserveMembers(LOBBY_ROOM, share);
+    }
+
+    if (!log_options.directory.empty())
+    {
+        int err = message_log.Open(&loop, log_options, "shard" + std::to_string(shard_id));
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    if (inherited_listener < 0)
+    {
+        int err = uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    return StartListening();
+}
+
+int ChatServer::StartListening()
+{
+    return uv_listen((uv_stream_t*) &server, 
+                     listen_backlog, 
+                     [](uv_stream_t* server, int status)
+                     {
+                         ChatServer::FromLoop(server->loop)->OnNewConnection(server, status);
+                     });
+}
+
+void ChatServer::Run()
+{
+    running = true;
+    uv_run(&loop, UV_RUN_DEFAULT);
+    running = false;
+}
+
+void ChatServer::CloseHandles()
+{
+    // sessions, listeners and timers alike; their state goes with the process
+    uv_walk(&loop,
+            [] (uv_handle_t* handle, void* arg)
+            {
+                if (!uv_is_closing(handle))
+                {
+                    uv_close(handle, nullptr);
+                }
+            },
+            nullptr);
+    // runs the close callbacks and the cancelled writes' completions
+    uv_run(&loop, UV_RUN_DEFAULT);
+}
+
+ChatServer::~ChatServer()
+{
+    // broadcasts that arrived after the loop stopped
+    for (Relayed* relayed : relay_inbox)
+    {
+        relayed->Release();
+    }
+    message_log.Close();
+    uv_loop_close(&loop);
+    std::cout << "Server Terminated";
+}
+
+void ChatServer::OnMsgSent(uv_write_t* req, int status)
+{
+    WriteReq* write = WritePool::FromRequest(req);
+    ChatSession* session = static_cast<ChatSession*>(req->handle->data);
+    session->inflight_bytes -= write->size;
+    metrics->Adjust(Gauge::WritesInFlight, -1);
+    metrics->Add(Counter::WritesCompleted);
+    if (status == 0)
+    {
+        metrics->Add(Counter::BytesOut, write->size);
+        metrics->Record(Histogram::WriteLatency, uv_hrtime() - write->queued_at);
+    }
+    else
+    {
+        metrics->Add(Counter::WriteErrors);
+    }
+    if (write->trace_id != 0)
+    {
+        trace->Record(TracePoint::WriteDone, write->trace_id, uv_hrtime(), status != 0);
+    }
+    FinishWrite(write);
+
+    if (!uv_is_closing((uv_handle_t*)req->handle))
+    {
+        FlushBacklog(session);
+    }
+
+    if (status != 0)
+    {
+        LOG_WARNING("Error sending message! %s", uv_strerror(status));
+    }
+}
@@ -0,0 +1,530 @@
+#include "handoff.h"
+#include "rooms.h"
+
+#include <uv.h>
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static const char HANDOFF_MAGIC[8] = { 'C', 'H', 'A', 'T', 'H', 'O', 'T', '1' };
+
+// message types on the handoff socket
+static const uint8_t HANDOFF_FDS = 'F';   // [count : 4] with count descriptors attached
+static const uint8_t HANDOFF_DATA = 'D';  // a chunk of the serialized state
+static const uint8_t HANDOFF_END = 'E';   // [state bytes : 8][descriptors : 8]
+static const uint8_t HANDOFF_ACK = 'A';
+
+// below the kernel's SCM_MAX_FD and the default socket buffer
+static const size_t FDS_PER_MESSAGE = 200;
+static const size_t DATA_PER_MESSAGE = 32 * 1024;
+// the successor restores every session before it acknowledges
+static const int ACK_TIMEOUT_SECONDS = 60;
+static const int IO_TIMEOUT_SECONDS = 10;
+
+SessionState::SessionState()
+    : shard(0)
+    , id(0)
+    , protocol(WireProtocol::Unknown)
+    , capabilities(0)
+    , named(false)
+    , current_room(0)
+    , fd(-1)
+{
+}
+
+HandoffState::HandoffState()
+    : next_sequence(0)
+    , metrics_listener(-1)
+{
+}
+
+static int LastError()
+{
+    return uv_translate_sys_error(errno);
+}
+
+static bool MakeAddress(const std::string& path, sockaddr_un* address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address->sun_path))
+    {
+        return false;
+    }
+    memcpy(address->sun_path, path.data(), path.size());
+    return true;
+}
+
+static void SetTimeouts(int fd, int seconds)
+{
+    timeval timeout = { seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// every socket of the server crosses this channel, only our own user
+// may be on the other end
+static int CheckPeer(int fd)
+{
+    ucred peer;
+    socklen_t len = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0)
+    {
+        return LastError();
+    }
+    return peer.uid == getuid() ? 0 : UV_EACCES;
+}
+
+int HandoffListen(const std::string& path, int* fd)
+{
+    sockaddr_un address;
+    if (!MakeAddress(path, &address))
+    {
+        return UV_ENAMETOOLONG;
+    }
+
+    // a stale socket of an earlier run goes, anything else stays
+    struct stat existing;
+    if (lstat(path.c_str(), &existing) == 0)
+    {
+        if (!S_ISSOCK(existing.st_mode))
+        {
+            return UV_EEXIST;
+        }
+        unlink(path.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+    {
+        return LastError();
+    }
+
+    // owner only before anyone can connect, which takes listen()
+    if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0
+        || chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0
+        || listen(listener, 1) != 0)
+    {
+        int err = LastError();
+        close(listener);
+        return err;
+    }
+
+    *fd = listener;
+    return 0;
+}
+
+int HandoffAccept(int listener, int* fd)
+{
+    int channel = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (channel < 0)
+    {
+        return LastError();
+    }
+
+    int err = CheckPeer(channel);
+    if (err != 0)
+    {
+        close(channel);
+        return err;
+    }
+
+    *fd = channel;
+    return 0;
+}
+
+int HandoffConnect(const std::string& path, int* fd)
+{
+    sockaddr_un address;
+    if (!MakeAddress(path, &address))
+    {
+        return UV_ENAMETOOLONG;
+    }
+
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (channel < 0)
+    {
+        return LastError();
+    }
+
+    if (connect(channel, (const sockaddr*)&address, sizeof(address)) != 0)
+    {
+        int err = LastError();
+        close(channel);
+        return err;
+    }
+
+    // the sockets we are about to serve must come from our own server
+    int err = CheckPeer(channel);
+    if (err != 0)
+    {
+        close(channel);
+        return err;
+    }
+
+    SetTimeouts(channel, IO_TIMEOUT_SECONDS);
+    *fd = channel;
+    return 0;
+}
+
+static int SendMessage(int fd, const void* data, size_t len, const int* fds, size_t fd_count)
+{
+    iovec chunk;
+    chunk.iov_base = const_cast<void*>(data);
+    chunk.iov_len = len;
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &chunk;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))];
+    if (fd_count != 0)
+    {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, fd_count * sizeof(int));
+    }
+
+    while (sendmsg(fd, &message, MSG_NOSIGNAL) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return LastError();
+        }
+    }
+    return 0;
+}
+
+static void PutBytes(std::string* out, const void* data, size_t len)
+{
+    out->append(static_cast<const char*>(data), len);
+}
+
+template<class T>
+static void Put(std::string* out, T value)
+{
+    PutBytes(out, &value, sizeof(value));
+}
+
+static void PutString(std::string* out, const std::string& value)
+{
+    Put<uint32_t>(out, value.size());
+    out->append(value);
+}
+
+// descriptors travel in state order: shard listeners, the metrics
+// listener if any, then one per session
+int SendHandoff(int fd, const HandoffState& state)
+{
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    SetTimeouts(fd, IO_TIMEOUT_SECONDS);
+
+    std::string image;
+    std::vector<int> fds;
+    PutBytes(&image, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC));
+    Put<uint64_t>(&image, state.next_sequence);
+    Put<uint32_t>(&image, state.shards.size());
+    for (const ShardState& shard : state.shards)
+    {
+        Put<uint64_t>(&image, shard.session_counter);
+        fds.push_back(shard.listener);
+    }
+    Put<uint8_t>(&image, state.metrics_listener >= 0);
+    if (state.metrics_listener >= 0)
+    {
+        fds.push_back(state.metrics_listener);
+    }
+
+    Put<uint64_t>(&image, state.sessions.size());
+    for (const SessionState& session : state.sessions)
+    {
+        Put<uint32_t>(&image, session.shard);
+        Put<uint64_t>(&image, session.id);
+        Put<uint8_t>(&image, (uint8_t)session.protocol);
+        Put<uint64_t>(&image, session.capabilities);
+        Put<uint8_t>(&image, session.named);
+        PutString(&image, session.name);
+        PutString(&image, session.partial);
+        Put<uint32_t>(&image, session.rooms.size());
+        for (const std::string& room : session.rooms)
+        {
+            PutString(&image, room);
+        }
+        Put<uint32_t>(&image, session.current_room);
+        fds.push_back(session.fd);
+    }
+
+    for (size_t sent = 0; sent < fds.size(); sent += FDS_PER_MESSAGE)
+    {
+        size_t count = std::min(FDS_PER_MESSAGE, fds.size() - sent);
+        char header[5];
+        header[0] = HANDOFF_FDS;
+        uint32_t count32 = count;
+        memcpy(header + 1, &count32, sizeof(count32));
+        int err = SendMessage(fd, header, sizeof(header), &fds[sent], count);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    std::string chunk;
+    for (size_t sent = 0; sent < image.size(); sent += DATA_PER_MESSAGE)
+    {
+        chunk.assign(1, (char)HANDOFF_DATA);
+        chunk.append(image, sent, DATA_PER_MESSAGE);
+        int err = SendMessage(fd, chunk.data(), chunk.size(), nullptr, 0);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    std::string end(1, (char)HANDOFF_END);
+    Put<uint64_t>(&end, image.size());
+    Put<uint64_t>(&end, fds.size());
+    return SendMessage(fd, end.data(), end.size(), nullptr, 0);
+}
+
+// Bounds-checked reads over the received image.
+class StateReader
+{
+public:
+    StateReader(const std::string& image)
+        : pos(image.data())
+        , end(image.data() + image.size())
+    {
+    }
+
+    bool Bytes(void* out, size_t len)
+    {
+        if ((size_t)(end - pos) < len)
+        {
+            return false;
+        }
+        memcpy(out, pos, len);
+        pos += len;
+        return true;
+    }
+
+    template<class T>
+    bool Get(T* value)
+    {
+        return Bytes(value, sizeof(*value));
+    }
+
+    bool String(std::string* value)
+    {
+        uint32_t len;
+        if (!Get(&len) || (size_t)(end - pos) < len)
+        {
+            return false;
+        }
+        value->assign(pos, len);
+        pos += len;
+        return true;
+    }
+
+protected:
+    const char* pos;
+    const char* end;
+};
+
+static bool ParseState(const std::string& image, const std::vector<int>& fds, HandoffState* state)
+{
+    StateReader reader(image);
+    char magic[sizeof(HANDOFF_MAGIC)];
+    uint32_t shard_count;
+    if (!reader.Bytes(magic, sizeof(magic)) || memcmp(magic, HANDOFF_MAGIC, sizeof(magic)) != 0
+        || !reader.Get(&state->next_sequence) || !reader.Get(&shard_count))
+    {
+        return false;
+    }
+
+    size_t next_fd = 0;
+    for (uint32_t i = 0; i < shard_count; i++)
+    {
+        ShardState shard;
+        if (!reader.Get(&shard.session_counter) || next_fd == fds.size())
+        {
+            return false;
+        }
+        shard.listener = fds[next_fd++];
+        state->shards.push_back(shard);
+    }
+
+    uint8_t has_metrics;
+    if (!reader.Get(&has_metrics))
+    {
+        return false;
+    }
+    if (has_metrics != 0)
+    {
+        if (next_fd == fds.size())
+        {
+            return false;
+        }
+        state->metrics_listener = fds[next_fd++];
+    }
+
+    uint64_t session_count;
+    if (!reader.Get(&session_count))
+    {
+        return false;
+    }
+    for (uint64_t i = 0; i < session_count; i++)
+    {
+        SessionState session;
+        uint8_t protocol;
+        uint8_t named;
+        uint32_t room_count;
+        if (!reader.Get(&session.shard) || session.shard >= shard_count
+            || !reader.Get(&session.id)
+            || !reader.Get(&protocol)
+            || !reader.Get(&session.capabilities)
+            || !reader.Get(&named)
+            || !reader.String(&session.name)
+            || !reader.String(&session.partial)
+            || !reader.Get(&room_count) || room_count > MAX_JOINED_ROOMS)
+        {
+            return false;
+        }
+
+        session.protocol = (WireProtocol)protocol;
+        session.named = named != 0;
+        session.rooms.resize(room_count);
+        for (std::string& room : session.rooms)
+        {
+            if (!reader.String(&room))
+            {
+                return false;
+            }
+        }
+        if (!reader.Get(&session.current_room) || next_fd == fds.size())
+        {
+            return false;
+        }
+        session.fd = fds[next_fd++];
+        state->sessions.push_back(session);
+    }
+    return next_fd == fds.size();
+}
+
+int ReceiveHandoff(int fd, HandoffState* state)
+{
+    std::vector<int> fds;
+    std::string image;
+    std::vector<char> buffer(DATA_PER_MESSAGE + 64);
+    char control[CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))];
+    int err = 0;
+
+    while (true)
+    {
+        iovec chunk;
+        chunk.iov_base = buffer.data();
+        chunk.iov_len = buffer.size();
+
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &chunk;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t len = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            err = len < 0 ? LastError() : UV_EOF;
+            break;
+        }
+
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+                size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int* received = reinterpret_cast<const int*>(CMSG_DATA(header));
+                fds.insert(fds.end(), received, received + count);
+            }
+        }
+        if ((message.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) != 0)
+        {
+            err = UV_EPROTO;
+            break;
+        }
+
+        if (buffer[0] == (char)HANDOFF_DATA)
+        {
+            image.append(buffer.data() + 1, len - 1);
+        }
+        else if (buffer[0] == (char)HANDOFF_END)
+        {
+            uint64_t sizes[2];
+            if (len != 1 + sizeof(sizes))
+            {
+                err = UV_EPROTO;
+                break;
+            }
+            memcpy(sizes, buffer.data() + 1, sizeof(sizes));
+            if (sizes[0] != image.size() || sizes[1] != fds.size() || !ParseState(image, fds, state))
+            {
+                err = UV_EPROTO;
+            }
+            break;
+        }
+        else if (buffer[0] != (char)HANDOFF_FDS)
+        {
+            err = UV_EPROTO;
+            break;
+        }
+    }
+
+    if (err != 0)
+    {
+        for (int received : fds)
+        {
+            close(received);
+        }
+        *state = HandoffState();
+    }
+    return err;
+}
+
+int SendHandoffAck(int fd)
+{
+    return SendMessage(fd, &HANDOFF_ACK, 1, nullptr, 0);
+}
+
+int WaitHandoffAck(int fd)
+{
+    SetTimeouts(fd, ACK_TIMEOUT_SECONDS);
+    char reply;
+    ssize_t len;
+    do
+    {
+        len = recv(fd, &reply, 1, 0);
+    }
+    while (len < 0 && errno == EINTR);
+
+    if (len < 0)
+    {
+        return LastError();
+    }
+    return len == 1 && reply == (char)HANDOFF_ACK ? 0 : UV_EPROTO;
+}
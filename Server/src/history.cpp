@@ -0,0 +1,60 @@
+#include "history.h"
+
+HistoryRing::HistoryRing()
+    : capacity(0)
+    , head(0)
+    , count(0)
+{
+}
+
+void HistoryRing::SetCapacity(size_t capacity)
+{
+    slots.reset(capacity > 0 ? new Outbound[capacity] : nullptr);
+    this->capacity = capacity;
+    head = 0;
+    count = 0;
+}
+
+void HistoryRing::Record(const Outbound& message)
+{
+    if (capacity == 0)
+    {
+        return;
+    }
+
+    slots[head].Assign(message);
+    head = (head + 1) % capacity;
+    if (count < capacity)
+    {
+        count++;
+    }
+}
+
+void HistoryRing::Collect(WireProtocol protocol, uint64_t capabilities, std::vector<Msg*>* payloads)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    size_t oldest = (head + capacity - count) % capacity;
+    for (size_t i = 0; i < count; i++)
+    {
+        payloads->push_back(slots[(oldest + i) % capacity].Encode(protocol, capabilities));
+    }
+}
+
+void HistoryRing::Clear()
+{
+    for (size_t i = 0; i < capacity; i++)
+    {
+        slots[i].Clear();
+    }
+    head = 0;
+    count = 0;
+}
+
+size_t HistoryRing::Size() const
+{
+    return count;
+}
@@ -3,23 +3,88 @@
 #include <iostream>
 #include <uv.h>
 #include <csignal>
+#include <algorithm>
+#include <sys/resource.h>
 
 #include "optionargs.h"
+#include "log.h"
 
-enum optionIndex { UNKNOWN, HELP, PORT };
+enum optionIndex { UNKNOWN, HELP, PORT, SHARDS, LOG_FILE, LOG_LEVEL,
+                   SLOW_POLICY, BACKLOG_BYTES, BACKLOG_MSGS, OUTBOUND_MB, HISTORY,
+                   MESSAGE_LOG, SEGMENT_MB, RETAIN_MB, RETAIN_HOURS, NO_FSYNC, METRICS_PORT,
+                   TRACE_SAMPLE, TRACE_EVENTS, TRACE_FILE, HANDOFF, CONN_RATE, CONN_BURST,
+                   MAX_PENDING, NAME_TIMEOUT, ACCEPT_BATCH, ACCEPT_LAG, MSG_RATE, MSG_BURST,
+                   MSG_DROPS, MAX_CONNECTIONS, LISTEN_BACKLOG, PRESENCE_LIMIT,
+                   IDLE_TIMEOUT };
 const option::Descriptor usage[] =
 {
     {UNKNOWN, 0, "", "", Arg::Unknown, "USAGE: Client -p PORT -n NICKNAME -a SERVER_ADDRESS" },
     {HELP, 0, "", "help", Arg::None, "--help \t Print usage and exit." },
     {PORT, 0, "p", "port", Arg::Numeric, "-p <port>, \t --port=<port> \t(number)"},
+    {SHARDS, 0, "s", "shards", Arg::Numeric, "-s <count>, \t --shards=<count> \t(number of event loops, default 1)"},
+    {LOG_FILE, 0, "", "log-file", Arg::Required, "--log-file=<path> \t log to a file instead of stderr"},
+    {LOG_LEVEL, 0, "", "log-level", Arg::Required, "--log-level=<level> \t debug, info, warn, error or none (default info)"},
+    {SLOW_POLICY, 0, "", "slow-policy", Arg::Required, "--slow-policy=<policy> \t drop-oldest (default), drop-newest or disconnect"},
+    {BACKLOG_BYTES, 0, "", "max-backlog-bytes", Arg::Numeric, "--max-backlog-bytes=<n> \t bytes queued per client before the slow policy applies"},
+    {BACKLOG_MSGS, 0, "", "max-backlog-msgs", Arg::Numeric, "--max-backlog-msgs=<n> \t messages queued per client before the slow policy applies"},
+    {OUTBOUND_MB, 0, "", "max-outbound-mb", Arg::Numeric, "--max-outbound-mb=<n> \t ceiling for all queued outgoing data"},
+    {HISTORY, 0, "", "history", Arg::Numeric, "--history=<n> \t chat messages per room replayed on join (default 32, 0 disables)"},
+    {MESSAGE_LOG, 0, "", "message-log", Arg::Required, "--message-log=<dir> \t keep every chat message in a log in this directory"},
+    {SEGMENT_MB, 0, "", "segment-mb", Arg::Numeric, "--segment-mb=<n> \t size of one message log file (default 64)"},
+    {RETAIN_MB, 0, "", "retain-mb", Arg::Numeric, "--retain-mb=<n> \t delete the oldest message log files past this size"},
+    {RETAIN_HOURS, 0, "", "retain-hours", Arg::Numeric, "--retain-hours=<n> \t delete message log files older than this"},
+    {NO_FSYNC, 0, "", "no-fsync", Arg::None, "--no-fsync \t don't wait for the disk, leave flushing to the OS"},
+    {METRICS_PORT, 0, "", "metrics-port", Arg::Numeric, "--metrics-port=<port> \t serve Prometheus metrics over HTTP on this port"},
+    {TRACE_SAMPLE, 0, "", "trace-sample", Arg::Numeric, "--trace-sample=<n> \t trace one in n chat messages; dump with SIGUSR1 or GET /trace"},
+    {TRACE_EVENTS, 0, "", "trace-events", Arg::Numeric, "--trace-events=<n> \t trace events kept per shard (default 65536)"},
+    {TRACE_FILE, 0, "", "trace-file", Arg::Required, "--trace-file=<path> \t where SIGUSR1 writes the trace (default chat-trace.json)"},
+    {HANDOFF, 0, "", "handoff", Arg::Required, "--handoff=<path> \t take over the connections of the server waiting on this Unix socket, then wait there for the next one"},
+    {CONN_RATE, 0, "", "max-conn-rate", Arg::Numeric, "--max-conn-rate=<n> \t new connections per second allowed from one address (default unlimited)"},
+    {CONN_BURST, 0, "", "max-conn-burst", Arg::Numeric, "--max-conn-burst=<n> \t connections one address may open at once on top of the rate (default the rate)"},
+    {MAX_PENDING, 0, "", "max-pending", Arg::Numeric, "--max-pending=<n> \t connections that haven't sent a name yet (default 16384, 0 for no limit)"},
+    {NAME_TIMEOUT, 0, "", "name-timeout", Arg::Numeric, "--name-timeout=<ms> \t time a new connection has to send its name (default 3000)"},
+    {ACCEPT_BATCH, 0, "", "accept-batch", Arg::Numeric, "--accept-batch=<n> \t connections accepted per loop iteration (default 64)"},
+    {ACCEPT_LAG, 0, "", "max-accept-lag", Arg::Numeric, "--max-accept-lag=<ms> \t stop accepting while the loop runs this late (default 100)"},
+    {MSG_RATE, 0, "", "max-msg-rate", Arg::Numeric, "--max-msg-rate=<n> \t messages per second one client may send, more are dropped (default unlimited)"},
+    {MSG_BURST, 0, "", "max-msg-burst", Arg::Numeric, "--max-msg-burst=<n> \t messages one client may send at once (default twice the rate)"},
+    {MSG_DROPS, 0, "", "max-msg-drops", Arg::Numeric, "--max-msg-drops=<n> \t dropped messages before a client that doesn't slow down is disconnected (default 100, 0 never)"},
+    {MAX_CONNECTIONS, 0, "", "max-connections", Arg::Numeric, "--max-connections=<n> \t connections to prepare for: raises the open file limit and sizes the session tables up front"},
+    {LISTEN_BACKLOG, 0, "", "listen-backlog", Arg::Numeric, "--listen-backlog=<n> \t connections the kernel queues for accepting (default 100, capped by net.core.somaxconn)"},
+    {PRESENCE_LIMIT, 0, "", "presence-limit", Arg::Numeric, "--presence-limit=<n> \t rooms bigger than this per shard don't announce joins and leaves (default 0, always)"},
+    {IDLE_TIMEOUT, 0, "", "idle-timeout", Arg::Numeric, "--idle-timeout=<ms> \t disconnect clients silent for this long (default 10000)"},
     { 0, 0, 0, 0, 0, 0 },
 };
 
-void term(int signum)
+// descriptors besides the clients': listeners, log files, epoll, metrics
+static const rlim_t SPARE_FILES = 64;
+
+// Lifts the soft open file limit to the hard one, and the hard one too
+// when more is wanted and the process is allowed to. Returns the limit.
+static rlim_t RaiseFileLimit(rlim_t wanted)
 {
-    fprintf(stderr, "Terminating Server\n");
-    ChatServer::GetInstance()->Broadcast("Server Terminating");
-    exit(signum);    
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        return 0;
+    }
+
+    if (limit.rlim_max != RLIM_INFINITY && wanted > limit.rlim_max)
+    {
+        rlimit raised = { wanted, wanted };
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+        {
+            return wanted;
+        }
+    }
+
+    // an unlimited hard limit still stops at fs.nr_open
+    rlimit lifted = limit;
+    lifted.rlim_cur = limit.rlim_max != RLIM_INFINITY ? limit.rlim_max : std::max(wanted, limit.rlim_cur);
+    if (setrlimit(RLIMIT_NOFILE, &lifted) == 0)
+    {
+        return lifted.rlim_cur;
+    }
+    return limit.rlim_cur;
 }
 
 int main(int argc, char* argv[])
@@ -52,11 +117,193 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    signal(SIGTERM, term);
-    signal(SIGINT, term);
+    LogLevel log_level = LogLevel::Info;
+    if (options[LOG_LEVEL] && !Logger::ParseLevel(options[LOG_LEVEL].arg, &log_level))
+    {
+        fprintf(stderr, "unknown log level %s\n", options[LOG_LEVEL].arg);
+        return 1;
+    }
+
+    const char* log_path = options[LOG_FILE] ? options[LOG_FILE].arg : nullptr;
+    if (!Logger::GetInstance()->Start(log_path, log_level))
+    {
+        fprintf(stderr, "cannot open log file %s\n", log_path);
+        return 1;
+    }
+
+    // SIGINT and SIGTERM are handled on the loop; vanished peers show up as
+    // write errors instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // the inherited limits stand unless asked to prepare for more
+    size_t max_connections = 0;
+    if (options[MAX_CONNECTIONS])
+    {
+        max_connections = std::stoul(options[MAX_CONNECTIONS].arg);
+        rlim_t files = RaiseFileLimit(max_connections + SPARE_FILES);
+        if (files < max_connections + SPARE_FILES)
+        {
+            fprintf(stderr, "warning: only %llu open files allowed, not enough for %zu connections\n",
+                    (unsigned long long)files, max_connections);
+        }
+    }
+
+    int shards = 1;
+    if (options[SHARDS])
+    {
+        shards = std::max(1, std::stoi(options[SHARDS].arg));
+    }
+
+    OutboundLimits limits;
+    if (options[SLOW_POLICY])
+    {
+        std::string policy = options[SLOW_POLICY].arg;
+        if (policy == "drop-oldest")
+        {
+            limits.policy = SlowConsumerPolicy::DropOldest;
+        }
+        else if (policy == "drop-newest")
+        {
+            limits.policy = SlowConsumerPolicy::DropNewest;
+        }
+        else if (policy == "disconnect")
+        {
+            limits.policy = SlowConsumerPolicy::Disconnect;
+        }
+        else
+        {
+            fprintf(stderr, "unknown slow consumer policy %s\n", policy.c_str());
+            return 1;
+        }
+    }
+
+    if (options[BACKLOG_BYTES])
+    {
+        limits.backlog_bytes = std::stoul(options[BACKLOG_BYTES].arg);
+    }
+
+    if (options[BACKLOG_MSGS])
+    {
+        limits.backlog_msgs = std::stoul(options[BACKLOG_MSGS].arg);
+    }
+
+    if (options[OUTBOUND_MB])
+    {
+        limits.total_bytes = std::stoul(options[OUTBOUND_MB].arg) * 1024 * 1024;
+    }
 
     ChatServer* server = ChatServer::GetInstance();
-    int err = server->Init(std::stoi(options[PORT].arg));
+    server->SetOutboundLimits(limits);
+    if (options[HISTORY])
+    {
+        server->SetHistorySize(std::stoul(options[HISTORY].arg));
+    }
+
+    AdmissionLimits admission;
+    if (options[CONN_RATE])
+    {
+        admission.per_address_rate = std::stod(options[CONN_RATE].arg);
+        admission.per_address_burst = admission.per_address_rate;
+    }
+    if (options[CONN_BURST])
+    {
+        admission.per_address_burst = std::stod(options[CONN_BURST].arg);
+    }
+    if (options[MAX_PENDING])
+    {
+        admission.max_pending = std::stoul(options[MAX_PENDING].arg);
+    }
+    if (options[NAME_TIMEOUT])
+    {
+        admission.name_timeout_ms = std::stoull(options[NAME_TIMEOUT].arg);
+    }
+    if (options[ACCEPT_BATCH])
+    {
+        admission.accept_batch = std::max<size_t>(1, std::stoul(options[ACCEPT_BATCH].arg));
+    }
+    if (options[ACCEPT_LAG])
+    {
+        admission.max_accept_lag_ms = std::stoull(options[ACCEPT_LAG].arg);
+    }
+    server->SetAdmissionLimits(admission);
+
+    SendLimits send_limits;
+    if (options[MSG_RATE])
+    {
+        send_limits.rate = std::stod(options[MSG_RATE].arg);
+        send_limits.burst = 2 * send_limits.rate;
+    }
+    if (options[MSG_BURST])
+    {
+        send_limits.burst = std::stod(options[MSG_BURST].arg);
+    }
+    send_limits.burst = std::max(1.0, send_limits.burst);
+    if (options[MSG_DROPS])
+    {
+        send_limits.max_drops = std::stoul(options[MSG_DROPS].arg);
+    }
+    server->SetSendLimits(send_limits);
+
+    server->SetConnectionCapacity(max_connections);
+    if (options[LISTEN_BACKLOG])
+    {
+        server->SetListenBacklog(std::max(1, std::stoi(options[LISTEN_BACKLOG].arg)));
+    }
+    if (options[IDLE_TIMEOUT])
+    {
+        server->SetIdleTimeout(std::stoull(options[IDLE_TIMEOUT].arg));
+    }
+    if (options[PRESENCE_LIMIT])
+    {
+        server->SetPresenceLimit(std::stoul(options[PRESENCE_LIMIT].arg));
+    }
+
+    if (options[METRICS_PORT])
+    {
+        server->SetMetricsPort(std::stoi(options[METRICS_PORT].arg));
+    }
+
+    if (options[TRACE_SAMPLE])
+    {
+        TraceOptions trace_options;
+        trace_options.sample_every = std::stoul(options[TRACE_SAMPLE].arg);
+        if (options[TRACE_EVENTS])
+        {
+            trace_options.ring_events = std::max<size_t>(1024, std::stoul(options[TRACE_EVENTS].arg));
+        }
+        if (options[TRACE_FILE])
+        {
+            trace_options.path = options[TRACE_FILE].arg;
+        }
+        Tracer::GetInstance()->Configure(trace_options);
+    }
+
+    if (options[HANDOFF])
+    {
+        server->SetHandoffPath(options[HANDOFF].arg);
+    }
+
+    if (options[MESSAGE_LOG])
+    {
+        MessageLogOptions log_options;
+        log_options.directory = options[MESSAGE_LOG].arg;
+        if (options[SEGMENT_MB])
+        {
+            // a segment has to fit the largest frame
+            log_options.segment_bytes = std::max<size_t>(2, std::stoul(options[SEGMENT_MB].arg)) * 1024 * 1024;
+        }
+        if (options[RETAIN_MB])
+        {
+            log_options.retain_bytes = std::stoull(options[RETAIN_MB].arg) * 1024 * 1024;
+        }
+        if (options[RETAIN_HOURS])
+        {
+            log_options.retain_seconds = std::stoull(options[RETAIN_HOURS].arg) * 3600;
+        }
+        log_options.sync = !options[NO_FSYNC];
+        server->SetMessageLog(log_options);
+    }
+    int err = server->Init(std::stoi(options[PORT].arg), shards);
 
     if (err != 0)
     {
@@ -0,0 +1,408 @@
+#include "messagelog.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SEGMENT_MAGIC[8] = { 'C', 'H', 'A', 'T', 'L', 'O', 'G', '1' };
+static const size_t SEGMENT_HEADER = 16;
+static const char SEGMENT_SUFFIX[] = ".seg";
+
+// On-disk record, followed by the room name and the text and padded to 8
+// bytes. The file is zero-filled, so a zero size marks the end of the data.
+struct LogRecordHeader
+{
+    uint32_t size; // room + text bytes
+    uint8_t type;
+    uint8_t room_length;
+    uint16_t reserved;
+    uint64_t sequence;
+    uint64_t sender;
+    int64_t timestamp_ms;
+};
+
+static inline size_t Align8(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+static int64_t NowMs()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+MessageLogOptions::MessageLogOptions()
+    : segment_bytes(64 * 1024 * 1024)
+    , retain_bytes(0)
+    , retain_seconds(0)
+    , sync(true)
+{
+}
+
+MessageLog::MessageLog()
+    : loop(nullptr)
+    , next_index(0)
+    , sync_running(false)
+    , dirty(false)
+    , job_sealed(0)
+    , job_error(0)
+    , closing(false)
+{
+    current.fd = -1;
+    current.base = nullptr;
+    current.used = 0;
+    current.last_write = 0;
+    sync_work.data = this;
+}
+
+MessageLog::~MessageLog()
+{
+    Close();
+}
+
+int MessageLog::Open(uv_loop_t* loop, const MessageLogOptions& options, const std::string& name)
+{
+    this->loop = loop;
+    this->options = options;
+    this->name = name;
+
+    if (mkdir(options.directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        return uv_translate_sys_error(errno);
+    }
+
+    // pick up segments of earlier runs so retention covers them too
+    DIR* dir = opendir(options.directory.c_str());
+    if (dir == nullptr)
+    {
+        return uv_translate_sys_error(errno);
+    }
+
+    std::vector<std::pair<uint64_t, Segment>> found;
+    std::string prefix = name + "-";
+    while (dirent* entry = readdir(dir))
+    {
+        std::string file = entry->d_name;
+        size_t suffix = file.size() - (sizeof(SEGMENT_SUFFIX) - 1);
+        if (file.size() <= prefix.size() + sizeof(SEGMENT_SUFFIX) - 1
+            || file.compare(0, prefix.size(), prefix) != 0
+            || file.compare(suffix, std::string::npos, SEGMENT_SUFFIX) != 0)
+        {
+            continue;
+        }
+
+        Segment segment;
+        segment.path = options.directory + "/" + file;
+        segment.fd = -1;
+        segment.base = nullptr;
+        segment.used = 0;
+
+        struct stat info;
+        if (stat(segment.path.c_str(), &info) != 0)
+        {
+            continue;
+        }
+        segment.last_write = info.st_mtime;
+
+        uint64_t index = strtoull(file.c_str() + prefix.size(), nullptr, 10);
+        next_index = std::max(next_index, index + 1);
+        found.push_back(std::make_pair(index, segment));
+    }
+    closedir(dir);
+
+    std::sort(found.begin(), found.end(),
+              [] (const std::pair<uint64_t, Segment>& a, const std::pair<uint64_t, Segment>& b)
+              {
+                  return a.first < b.first;
+              });
+    for (auto& segment : found)
+    {
+        sealed.push_back(segment.second);
+    }
+
+    return OpenSegment();
+}
+
+bool MessageLog::IsOpen() const
+{
+    return current.base != nullptr && !closing;
+}
+
+std::string MessageLog::SegmentPath(uint64_t index) const
+{
+    char file[32];
+    snprintf(file, sizeof(file), "-%016llu", (unsigned long long)index);
+    return options.directory + "/" + name + file + SEGMENT_SUFFIX;
+}
+
+int MessageLog::OpenSegment()
+{
+    std::string path = SegmentPath(next_index++);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return uv_translate_sys_error(errno);
+    }
+
+    // the full size up front: appends never change the file's metadata,
+    // which keeps fdatasync down to the data pages
+    int err = posix_fallocate(fd, 0, options.segment_bytes);
+    if (err != 0)
+    {
+        close(fd);
+        unlink(path.c_str());
+        return uv_translate_sys_error(err);
+    }
+
+    void* base = mmap(nullptr, options.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        err = uv_translate_sys_error(errno);
+        close(fd);
+        unlink(path.c_str());
+        return err;
+    }
+
+    current.path = path;
+    current.fd = fd;
+    current.base = static_cast<char*>(base);
+    current.last_write = NowMs() / 1000;
+    memcpy(current.base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    current.used = SEGMENT_HEADER;
+    dirty = true;
+    return 0;
+}
+
+void MessageLog::Seal()
+{
+    // dirty pages outlive the mapping, the fd stays open until synced
+    munmap(current.base, options.segment_bytes);
+    unsynced_fds.push_back(current.fd);
+
+    Segment done = current;
+    done.fd = -1;
+    done.base = nullptr;
+    sealed.push_back(done);
+
+    current.fd = -1;
+    current.base = nullptr;
+    current.used = 0;
+    EnforceRetention();
+}
+
+void MessageLog::Append(FrameType type,
+                        uint64_t sender,
+                        uint64_t sequence,
+                        const std::string& room,
+                        const char* text,
+                        size_t len)
+{
+    if (!IsOpen())
+    {
+        return;
+    }
+
+    size_t room_length = std::min<size_t>(room.size(), UINT8_MAX);
+    size_t record = Align8(sizeof(LogRecordHeader) + room_length + len);
+    if (record > options.segment_bytes - SEGMENT_HEADER)
+    {
+        LOG_WARNING("Message of %zu bytes does not fit a log segment", len);
+        return;
+    }
+
+    if (current.used + record > options.segment_bytes)
+    {
+        Seal();
+        int err = OpenSegment();
+        if (err != 0)
+        {
+            LOG_ERROR("Message log stopped, can't open a segment: %s", uv_strerror(err));
+            return;
+        }
+    }
+
+    int64_t now = NowMs();
+    LogRecordHeader header;
+    header.size = room_length + len;
+    header.type = (uint8_t)type;
+    header.room_length = room_length;
+    header.reserved = 0;
+    header.sequence = sequence;
+    header.sender = sender;
+    header.timestamp_ms = now;
+
+    // the size goes in last, until then the record reads as the end of the log
+    char* out = current.base + current.used;
+    memcpy(out + sizeof(header.size), (char*)&header + sizeof(header.size), sizeof(header) - sizeof(header.size));
+    memcpy(out + sizeof(header), room.data(), room_length);
+    memcpy(out + sizeof(header) + room_length, text, len);
+    memcpy(out, &header.size, sizeof(header.size));
+
+    current.used += record;
+    current.last_write = now / 1000;
+    dirty = true;
+    ScheduleSync();
+}
+
+void MessageLog::ScheduleSync()
+{
+    bool needs_sync = options.sync && dirty && current.fd >= 0;
+    if (sync_running || (!needs_sync && unsynced_fds.empty() && expired.empty()))
+    {
+        return;
+    }
+
+    // sealed segments first: they are synced, then closed
+    job_fds = unsynced_fds;
+    job_sealed = unsynced_fds.size();
+    if (needs_sync)
+    {
+        job_fds.push_back(current.fd);
+    }
+    job_unlink.clear();
+    job_unlink.swap(expired);
+    job_error = 0;
+
+    unsynced_fds.clear();
+    dirty = false;
+
+    sync_running = true;
+    uv_queue_work(loop,
+                  &sync_work,
+                  [] (uv_work_t* req)
+                  {
+                      // thread pool: only the job_ members are touched here
+                      MessageLog* log = static_cast<MessageLog*>(req->data);
+                      for (size_t i = 0; i < log->job_fds.size(); i++)
+                      {
+                          if (log->options.sync && fdatasync(log->job_fds[i]) != 0 && log->job_error == 0)
+                          {
+                              log->job_error = uv_translate_sys_error(errno);
+                          }
+                          if (i < log->job_sealed)
+                          {
+                              close(log->job_fds[i]);
+                          }
+                      }
+                      for (const std::string& path : log->job_unlink)
+                      {
+                          unlink(path.c_str());
+                      }
+                  },
+                  [] (uv_work_t* req, int status)
+                  {
+                      static_cast<MessageLog*>(req->data)->OnSyncDone(status);
+                  });
+}
+
+void MessageLog::OnSyncDone(int status)
+{
+    sync_running = false;
+    if (status != 0)
+    {
+        // the job never ran, what it was given goes with the next one
+        LOG_ERROR("Message log sync did not run: %s", uv_strerror(status));
+        unsynced_fds.insert(unsynced_fds.end(), job_fds.begin(), job_fds.begin() + job_sealed);
+        expired.insert(expired.end(), job_unlink.begin(), job_unlink.end());
+        dirty = dirty || job_fds.size() > job_sealed;
+    }
+    else if (job_error != 0)
+    {
+        LOG_ERROR("Message log sync failed: %s", uv_strerror(job_error));
+    }
+
+    if (closing)
+    {
+        Finish();
+        std::function<void()> closed;
+        closed.swap(on_closed);
+        if (closed)
+        {
+            closed();
+        }
+        return;
+    }
+
+    EnforceRetention();
+    // appends that arrived meanwhile form the next group
+    ScheduleSync();
+}
+
+void MessageLog::EnforceRetention()
+{
+    uint64_t total = (uint64_t)(sealed.size() + 1) * options.segment_bytes;
+    int64_t now = NowMs() / 1000;
+    while (!sealed.empty())
+    {
+        bool too_big = options.retain_bytes != 0 && total > options.retain_bytes;
+        bool too_old = options.retain_seconds != 0
+                    && now - sealed.front().last_write > (int64_t)options.retain_seconds;
+        if (!too_big && !too_old)
+        {
+            break;
+        }
+
+        expired.push_back(sealed.front().path);
+        sealed.pop_front();
+        total -= options.segment_bytes;
+    }
+}
+
+void MessageLog::Close(std::function<void()> closed)
+{
+    if (!IsOpen())
+    {
+        if (closed)
+        {
+            closed();
+        }
+        return;
+    }
+
+    closing = true;
+    if (sync_running)
+    {
+        // the job may be syncing current.fd, OnSyncDone finishes the close
+        on_closed = std::move(closed);
+        return;
+    }
+
+    Finish();
+    if (closed)
+    {
+        closed();
+    }
+}
+
+void MessageLog::Finish()
+{
+    for (int fd : unsynced_fds)
+    {
+        if (options.sync)
+        {
+            fdatasync(fd);
+        }
+        close(fd);
+    }
+    unsynced_fds.clear();
+
+    if (options.sync)
+    {
+        fdatasync(current.fd);
+    }
+    munmap(current.base, options.segment_bytes);
+    close(current.fd);
+    current.fd = -1;
+    current.base = nullptr;
+    closing = false;
+}
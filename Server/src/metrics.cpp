@@ -0,0 +1,210 @@
+#include "metrics.h"
+
+#include <cstdio>
+
+struct MetricInfo
+{
+    const char* name;
+    const char* help;
+};
+
+static const MetricInfo COUNTER_INFO[(int)Counter::COUNT] =
+{
+    { "chat_connections_accepted_total", "Connections accepted." },
+    { "chat_connections_closed_total", "Connections closed." },
+    { "chat_connections_rejected_total", "Connections closed by admission control right after accepting." },
+    { "chat_received_bytes_total", "Bytes read from clients." },
+    { "chat_sent_bytes_total", "Bytes written to clients." },
+    { "chat_messages_received_total", "Chat messages received." },
+    { "chat_broadcasts_total", "Messages fanned out to a room." },
+    { "chat_writes_completed_total", "Writes completed, successfully or not." },
+    { "chat_write_errors_total", "Writes that failed or were cancelled." },
+    { "chat_writes_dropped_total", "Writes discarded by the slow-consumer policy." },
+    { "chat_slow_consumers_total", "Sessions disconnected for not keeping up." },
+    { "chat_messages_rate_limited_total", "Frames dropped for exceeding the sender's rate." },
+    { "chat_flooders_total", "Sessions disconnected for sending too fast." },
+};
+
+static const MetricInfo GAUGE_INFO[(int)Gauge::COUNT] =
+{
+    { "chat_sessions", "Open client connections." },
+    { "chat_pending_sessions", "Open connections that have not sent a name yet." },
+    { "chat_writes_in_flight", "Writes handed to libuv and not completed yet." },
+    { "chat_backlog_messages", "Messages waiting behind in-flight writes." },
+    { "chat_outbound_bytes", "Bytes queued or in flight towards clients." },
+};
+
+static const MetricInfo HISTOGRAM_INFO[(int)Histogram::COUNT] =
+{
+    { "chat_recv_to_broadcast_seconds", "Time from the read callback until a message is queued to its room." },
+    { "chat_write_seconds", "Time from queueing a write until it completes." },
+};
+
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+LatencyHistogram::LatencyHistogram()
+    : sum_us(0)
+{
+    for (std::atomic<uint64_t>& count : counts)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::BucketFor(uint64_t value_us)
+{
+    if (value_us < 2 * SUB_BUCKETS)
+    {
+        return (int)value_us;
+    }
+
+    // the top six bits of the value pick the bucket
+    int msb = 63 - __builtin_clzll(value_us);
+    int shift = msb - 5;
+    int bucket = (shift + 1) * SUB_BUCKETS + (int)((value_us >> shift) - SUB_BUCKETS);
+    return bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT - 1;
+}
+
+uint64_t LatencyHistogram::BucketLimit(int bucket)
+{
+    if (bucket < 2 * SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t value_us)
+{
+    // single writer, see MetricsShard
+    std::atomic<uint64_t>& count = counts[BucketFor(value_us)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum_us.store(sum_us.load(std::memory_order_relaxed) + value_us, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    for (int b = 0; b < BUCKET_COUNT; b++)
+    {
+        counts[b].fetch_add(other.counts[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    sum_us.fetch_add(other.sum_us.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Count() const
+{
+    uint64_t total = 0;
+    for (const std::atomic<uint64_t>& count : counts)
+    {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t LatencyHistogram::ValueAtQuantile(double quantile) const
+{
+    uint64_t rank = (uint64_t)(quantile * Count() + 0.5);
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKET_COUNT; b++)
+    {
+        uint64_t count = counts[b].load(std::memory_order_relaxed);
+        seen += count;
+        if (count != 0 && seen >= rank)
+        {
+            return BucketLimit(b);
+        }
+    }
+    return 0;
+}
+
+MetricsShard::MetricsShard()
+{
+    for (std::atomic<uint64_t>& counter : counters)
+    {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (std::atomic<int64_t>& gauge : gauges)
+    {
+        gauge.store(0, std::memory_order_relaxed);
+    }
+}
+
+MetricsRegistry* MetricsRegistry::GetInstance()
+{
+    static MetricsRegistry registry;
+    return &registry;
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+}
+
+MetricsShard* MetricsRegistry::Register()
+{
+    std::lock_guard<std::mutex> guard(shards_lock);
+    shards.emplace_back(new MetricsShard());
+    return shards.back().get();
+}
+
+static void AppendHeader(std::string* out, const MetricInfo& info, const char* type)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", info.name, info.help, info.name, type);
+    out->append(line);
+}
+
+void MetricsRegistry::Render(std::string* out)
+{
+    std::lock_guard<std::mutex> guard(shards_lock);
+    char line[256];
+
+    for (int i = 0; i < (int)Counter::COUNT; i++)
+    {
+        uint64_t value = 0;
+        for (auto& shard : shards)
+        {
+            value += shard->counters[i].load(std::memory_order_relaxed);
+        }
+        AppendHeader(out, COUNTER_INFO[i], "counter");
+        snprintf(line, sizeof(line), "%s %llu\n", COUNTER_INFO[i].name, (unsigned long long)value);
+        out->append(line);
+    }
+
+    for (int i = 0; i < (int)Gauge::COUNT; i++)
+    {
+        int64_t value = 0;
+        for (auto& shard : shards)
+        {
+            value += shard->gauges[i].load(std::memory_order_relaxed);
+        }
+        AppendHeader(out, GAUGE_INFO[i], "gauge");
+        snprintf(line, sizeof(line), "%s %lld\n", GAUGE_INFO[i].name, (long long)value);
+        out->append(line);
+    }
+
+    // histograms go out as summaries, the bucket layout is too fine for
+    // Prometheus to store
+    for (int i = 0; i < (int)Histogram::COUNT; i++)
+    {
+        std::unique_ptr<LatencyHistogram> merged(new LatencyHistogram());
+        for (auto& shard : shards)
+        {
+            merged->Merge(shard->histograms[i]);
+        }
+
+        const char* name = HISTOGRAM_INFO[i].name;
+        AppendHeader(out, HISTOGRAM_INFO[i], "summary");
+        for (double quantile : QUANTILES)
+        {
+            snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.6f\n",
+                     name, quantile, merged->ValueAtQuantile(quantile) / 1e6);
+            out->append(line);
+        }
+        snprintf(line, sizeof(line), "%s_sum %.6f\n%s_count %llu\n",
+                 name, merged->sum_us.load() / 1e6, name, (unsigned long long)merged->Count());
+        out->append(line);
+    }
+}
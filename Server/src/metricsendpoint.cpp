@@ -0,0 +1,190 @@
+#include "metricsendpoint.h"
+#include "metrics.h"
+#include "tracing.h"
+#include "log.h"
+
+#include <cstring>
+#include <unistd.h>
+
+// a scrape request is a single GET line plus a few headers
+static const size_t MAX_REQUEST = 8192;
+static const char PROMETHEUS_TYPE[] = "text/plain; version=0.0.4";
+
+MetricsEndpoint::MetricsEndpoint()
+    : listening(false)
+{
+}
+
+int MetricsEndpoint::Listen(uv_loop_t* loop, int port)
+{
+    uv_tcp_init(loop, &server);
+    server.data = this;
+
+    sockaddr_in addr;
+    uv_ip4_addr("0.0.0.0", port, &addr);
+    int err = uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    return StartListening();
+}
+
+int MetricsEndpoint::Adopt(uv_loop_t* loop, int fd)
+{
+    uv_tcp_init(loop, &server);
+    server.data = this;
+    int err = uv_tcp_open(&server, fd);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    return StartListening();
+}
+
+int MetricsEndpoint::Detach()
+{
+    if (!listening)
+    {
+        return -1;
+    }
+
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)&server, &fd);
+    int copy = dup(fd);
+    uv_close((uv_handle_t*)&server, nullptr);
+    listening = false;
+    return copy;
+}
+
+int MetricsEndpoint::StartListening()
+{
+    int err = uv_listen((uv_stream_t*)&server,
+                        16,
+                        [] (uv_stream_t* server, int status)
+                        {
+                            static_cast<MetricsEndpoint*>(server->data)->OnConnection(server, status);
+                        });
+    listening = err == 0;
+    return err;
+}
+
+void MetricsEndpoint::OnConnection(uv_stream_t* server, int status)
+{
+    if (status != 0)
+    {
+        LOG_WARNING("Metrics connection error: %s", uv_strerror(status));
+        return;
+    }
+
+    Scrape* scrape = new Scrape();
+    uv_tcp_init(server->loop, &scrape->handle);
+    scrape->handle.data = this;
+    scrape->write.data = scrape;
+    if (uv_accept(server, (uv_stream_t*)&scrape->handle) != 0)
+    {
+        Close(scrape);
+        return;
+    }
+
+    uv_read_start((uv_stream_t*)&scrape->handle,
+                  [] (uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+                  {
+                      static char buffer[1024];
+                      *buf = uv_buf_init(buffer, sizeof(buffer));
+                  },
+                  [] (uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+                  {
+                      Scrape* scrape = reinterpret_cast<Scrape*>(stream);
+                      static_cast<MetricsEndpoint*>(stream->data)->OnRead(scrape, nread, buf);
+                  });
+}
+
+void MetricsEndpoint::OnRead(Scrape* scrape, ssize_t nread, const uv_buf_t* buf)
+{
+    if (nread < 0)
+    {
+        Close(scrape);
+        return;
+    }
+
+    scrape->request.append(buf->base, nread);
+    if (scrape->request.find("\r\n\r\n") != std::string::npos)
+    {
+        uv_read_stop((uv_stream_t*)&scrape->handle);
+        Respond(scrape);
+    }
+    else if (scrape->request.size() > MAX_REQUEST)
+    {
+        Close(scrape);
+    }
+}
+
+void MetricsEndpoint::Respond(Scrape* scrape)
+{
+    if (scrape->request.compare(0, 13, "GET /metrics ") == 0
+        || scrape->request.compare(0, 14, "GET /metrics?") == 0)
+    {
+        MetricsRegistry::GetInstance()->Render(&scrape->body);
+        Send(scrape, "200 OK", PROMETHEUS_TYPE);
+    }
+    else if (scrape->request.compare(0, 11, "GET /trace ") == 0 && Tracer::GetInstance()->IsEnabled())
+    {
+        // copying and sorting every shard's ring takes long enough to hold
+        // up the chat this loop serves, the thread pool does it
+        scrape->render.data = scrape;
+        uv_queue_work(scrape->handle.loop,
+                      &scrape->render,
+                      [] (uv_work_t* req)
+                      {
+                          Tracer::GetInstance()->Render(&static_cast<Scrape*>(req->data)->body);
+                      },
+                      [] (uv_work_t* req, int status)
+                      {
+                          Scrape* scrape = static_cast<Scrape*>(req->data);
+                          if (uv_is_closing((uv_handle_t*)&scrape->handle))
+                          {
+                              // the server is shutting down
+                              return;
+                          }
+                          Send(scrape, status == 0 ? "200 OK" : "503 Service Unavailable", "application/json");
+                      });
+    }
+    else
+    {
+        Send(scrape, "404 Not Found", PROMETHEUS_TYPE);
+    }
+}
+
+void MetricsEndpoint::Send(Scrape* scrape, const char* status, const char* type)
+{
+    scrape->response = "HTTP/1.1 ";
+    scrape->response += status;
+    scrape->response += "\r\nContent-Type: ";
+    scrape->response += type;
+    scrape->response += "\r\nContent-Length: ";
+    scrape->response += std::to_string(scrape->body.size());
+    scrape->response += "\r\nConnection: close\r\n\r\n";
+    scrape->response += scrape->body;
+
+    uv_buf_t buf = uv_buf_init(&scrape->response[0], scrape->response.size());
+    uv_write(&scrape->write,
+             (uv_stream_t*)&scrape->handle,
+             &buf,
+             1,
+             [] (uv_write_t* req, int status)
+             {
+                 Close(static_cast<Scrape*>(req->data));
+             });
+}
+
+void MetricsEndpoint::Close(Scrape* scrape)
+{
+    uv_close((uv_handle_t*)&scrape->handle,
+             [] (uv_handle_t* handle)
+             {
+                 delete reinterpret_cast<Scrape*>(handle);
+             });
+}
@@ -0,0 +1,208 @@
+#include "nameregistry.h"
+
+#include <cctype>
+#include <cstring>
+
+static const size_t INITIAL_BUCKETS = 64;
+static const size_t MIN_COMPACT_BYTES = 4096;
+
+static inline char Fold(char c)
+{
+    return (char)::tolower((unsigned char)c);
+}
+
+NameRegistry::NameRegistry()
+    : table(INITIAL_BUCKETS)
+    , count(0)
+    , garbage(0)
+{
+}
+
+uint32_t NameRegistry::Hash(const char* name, size_t len)
+{
+    // FNV-1a over the folded bytes
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)Fold(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool NameRegistry::Matches(const Entry& entry, uint32_t hash, const char* name, size_t len) const
+{
+    if (entry.hash != hash || entry.length != len)
+    {
+        return false;
+    }
+
+    const char* stored = arena.data() + entry.offset;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (stored[i] != Fold(name[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t NameRegistry::Locate(uint32_t hash, const char* name, size_t len) const
+{
+    size_t mask = table.size() - 1;
+    for (size_t pos = hash & mask; ; pos = (pos + 1) & mask)
+    {
+        const Entry& entry = table[pos];
+        if (entry.length == 0 || Matches(entry, hash, name, len))
+        {
+            return pos;
+        }
+    }
+}
+
+bool NameRegistry::Insert(const std::string& name, NameOwner owner)
+{
+    if (name.empty())
+    {
+        return false;
+    }
+
+    // keep the load factor under 3/4
+    if ((count + 1) * 4 > table.size() * 3)
+    {
+        Grow();
+    }
+
+    uint32_t hash = Hash(name.data(), name.size());
+    size_t pos = Locate(hash, name.data(), name.size());
+    if (table[pos].length != 0)
+    {
+        return false;
+    }
+
+    Entry& entry = table[pos];
+    entry.hash = hash;
+    entry.offset = arena.size();
+    entry.length = name.size();
+    entry.owner = owner;
+    for (char c : name)
+    {
+        arena.push_back(Fold(c));
+    }
+    count++;
+    return true;
+}
+
+bool NameRegistry::Find(const std::string& name, NameOwner* owner) const
+{
+    if (name.empty())
+    {
+        return false;
+    }
+
+    size_t pos = Locate(Hash(name.data(), name.size()), name.data(), name.size());
+    if (table[pos].length == 0)
+    {
+        return false;
+    }
+
+    if (owner != nullptr)
+    {
+        *owner = table[pos].owner;
+    }
+    return true;
+}
+
+bool NameRegistry::Remove(const std::string& name)
+{
+    if (name.empty())
+    {
+        return false;
+    }
+
+    size_t pos = Locate(Hash(name.data(), name.size()), name.data(), name.size());
+    if (table[pos].length == 0)
+    {
+        return false;
+    }
+
+    garbage += table[pos].length;
+    count--;
+
+    // backward-shift deletion keeps probe chains intact without tombstones
+    size_t mask = table.size() - 1;
+    size_t hole = pos;
+    for (size_t next = (hole + 1) & mask; table[next].length != 0; next = (next + 1) & mask)
+    {
+        size_t home = table[next].hash & mask;
+        // move the entry into the hole unless its home lies cyclically in (hole, next]
+        bool stays = (hole <= next) ? (hole < home && home <= next)
+                                    : (hole < home || home <= next);
+        if (!stays)
+        {
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+    table[hole].length = 0;
+
+    if (garbage > MIN_COMPACT_BYTES && garbage * 2 > arena.size())
+    {
+        Compact();
+    }
+    return true;
+}
+
+size_t NameRegistry::Size() const
+{
+    return count;
+}
+
+void NameRegistry::Reserve(size_t names)
+{
+    while (names * 4 > table.size() * 3)
+    {
+        Grow();
+    }
+    // room for names of typical length
+    arena.reserve(names * 16);
+}
+
+void NameRegistry::Grow()
+{
+    std::vector<Entry> old;
+    old.swap(table);
+    table.resize(old.size() * 2);
+
+    size_t mask = table.size() - 1;
+    for (const Entry& entry : old)
+    {
+        if (entry.length != 0)
+        {
+            size_t pos = entry.hash & mask;
+            while (table[pos].length != 0)
+            {
+                pos = (pos + 1) & mask;
+            }
+            table[pos] = entry;
+        }
+    }
+}
+
+void NameRegistry::Compact()
+{
+    std::vector<char> packed;
+    packed.reserve(arena.size() - garbage);
+    for (Entry& entry : table)
+    {
+        if (entry.length != 0)
+        {
+            uint32_t offset = packed.size();
+            packed.insert(packed.end(), arena.begin() + entry.offset, arena.begin() + entry.offset + entry.length);
+            entry.offset = offset;
+        }
+    }
+    arena.swap(packed);
+    garbage = 0;
+}
@@ -0,0 +1,198 @@
+#include "outbound.h"
+#include "compression.h"
+
+#include <algorithm>
+#include <vector>
+
+// below this, deflating costs more than the bytes it saves
+static const size_t COMPRESS_MIN_BYTES = 512;
+
+Outbound::Outbound()
+    : allocator(nullptr)
+    , type(FrameType::System)
+    , sender(0)
+    , sequence(0)
+    , text(nullptr)
+    , compressed(nullptr)
+{
+    for (Msg*& encoding : encodings)
+    {
+        encoding = nullptr;
+    }
+}
+
+Outbound::Outbound(MsgAllocator* allocator, FrameType type, uint64_t sender, uint64_t sequence)
+    : allocator(allocator)
+    , type(type)
+    , sender(sender)
+    , sequence(sequence)
+    , text(nullptr)
+    , compressed(nullptr)
+{
+    for (Msg*& encoding : encodings)
+    {
+        encoding = nullptr;
+    }
+}
+
+Outbound::~Outbound()
+{
+    Clear();
+}
+
+void Outbound::Assign(const Outbound& other)
+{
+    Clear();
+    allocator = other.allocator;
+    type = other.type;
+    sender = other.sender;
+    sequence = other.sequence;
+
+    text = other.text;
+    if (text != nullptr)
+    {
+        text->AddRef();
+    }
+
+    for (int i = 0; i < WIRE_PROTOCOL_COUNT; i++)
+    {
+        encodings[i] = other.encodings[i];
+        if (encodings[i] != nullptr)
+        {
+            encodings[i]->AddRef();
+        }
+    }
+
+    compressed = other.compressed;
+    if (compressed != nullptr)
+    {
+        compressed->AddRef();
+    }
+}
+
+void Outbound::Clear()
+{
+    if (text != nullptr)
+    {
+        text->Release();
+        text = nullptr;
+    }
+
+    for (Msg*& encoding : encodings)
+    {
+        if (encoding != nullptr)
+        {
+            encoding->Release();
+            encoding = nullptr;
+        }
+    }
+
+    if (compressed != nullptr)
+    {
+        compressed->Release();
+        compressed = nullptr;
+    }
+}
+
+void Outbound::SetText(const char* text, size_t len)
+{
+    AdoptText(allocator->Create(text, len));
+}
+
+void Outbound::AdoptText(Msg* text)
+{
+    this->text = text;
+}
+
+Msg* Outbound::Encode(WireProtocol protocol, uint64_t capabilities)
+{
+    if (protocol == WireProtocol::V2 && (capabilities & CAP_DEFLATE) != 0 && TextSize() >= COMPRESS_MIN_BYTES)
+    {
+        return EncodeCompressed();
+    }
+
+    Msg*& encoding = encodings[(int)protocol];
+    if (encoding != nullptr)
+    {
+        return encoding;
+    }
+
+    if (protocol == WireProtocol::V2)
+    {
+        encoding = EncodeFrame(*allocator, Header(), Text(), TextSize());
+    }
+    else if (FindDelimiter(Text(), Text() + TextSize(), 0) == nullptr)
+    {
+        text->AddRef();
+        encoding = text;
+    }
+    else
+    {
+        // NULs sent over v2 would end the frame early for legacy peers
+        encoding = allocator->Create(Text(), TextSize());
+        std::replace(encoding->Data(), encoding->Data() + TextSize(), '\0', ' ');
+    }
+    return encoding;
+}
+
+Msg* Outbound::EncodeCompressed()
+{
+    if (compressed != nullptr)
+    {
+        return compressed;
+    }
+
+    static thread_local std::vector<char> packed;
+    if (Deflate(Text(), TextSize(), &packed) && packed.size() < TextSize())
+    {
+        FrameHeader header = Header();
+        header.flags |= FRAME_FLAG_COMPRESSED;
+        compressed = EncodeFrame(*allocator, header, packed.data(), packed.size());
+    }
+    else
+    {
+        compressed = Encode(WireProtocol::V2);
+        compressed->AddRef();
+    }
+    return compressed;
+}
+
+FrameHeader Outbound::Header() const
+{
+    FrameHeader header = { type, 0, sender, sequence };
+    if (sender != 0)
+    {
+        header.flags |= FRAME_FLAG_SENDER;
+    }
+    if (sequence != 0)
+    {
+        header.flags |= FRAME_FLAG_SEQUENCE;
+    }
+    return header;
+}
+
+const char* Outbound::Text()
+{
+    return text->Data();
+}
+
+size_t Outbound::TextSize()
+{
+    // without the trailing NUL
+    return text->Size() - 1;
+}
+
+FrameType Outbound::Type() const
+{
+    return type;
+}
+
+uint64_t Outbound::Sender() const
+{
+    return sender;
+}
+
+uint64_t Outbound::Sequence() const
+{
+    return sequence;
+}
@@ -0,0 +1,77 @@
+#include "readbufferpool.h"
+
+static const size_t SMALLEST_CLASS = 2048;
+
+ReadBufferPool::ReadBufferPool()
+    : bytes_in_use(0)
+    , bytes_pooled(0)
+{
+}
+
+ReadBufferPool::~ReadBufferPool()
+{
+    for (auto& free_list : free_lists)
+    {
+        for (char* buffer : free_list)
+        {
+            delete[] buffer;
+        }
+    }
+}
+
+size_t ReadBufferPool::ClassSize(int size_class)
+{
+    return SMALLEST_CLASS << (2 * size_class);
+}
+
+int ReadBufferPool::ClassFor(size_t size)
+{
+    int size_class = 0;
+    while (size_class + 1 < CLASS_COUNT && ClassSize(size_class + 1) <= size)
+    {
+        size_class++;
+    }
+    return size_class;
+}
+
+char* ReadBufferPool::Acquire(int size_class)
+{
+    bytes_in_use += ClassSize(size_class);
+
+    std::vector<char*>& free_list = free_lists[size_class];
+    if (free_list.empty())
+    {
+        return new char[ClassSize(size_class)];
+    }
+
+    char* buffer = free_list.back();
+    free_list.pop_back();
+    bytes_pooled -= ClassSize(size_class);
+    return buffer;
+}
+
+void ReadBufferPool::Release(char* buffer, int size_class)
+{
+    bytes_in_use -= ClassSize(size_class);
+
+    std::vector<char*>& free_list = free_lists[size_class];
+    if (free_list.size() < KEEP_FREE)
+    {
+        free_list.push_back(buffer);
+        bytes_pooled += ClassSize(size_class);
+    }
+    else
+    {
+        delete[] buffer;
+    }
+}
+
+size_t ReadBufferPool::BytesInUse() const
+{
+    return bytes_in_use;
+}
+
+size_t ReadBufferPool::BytesPooled() const
+{
+    return bytes_pooled;
+}
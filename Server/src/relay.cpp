@@ -0,0 +1,150 @@
+#include "relay.h"
+
+#include <cstring>
+#include <new>
+
+Relayed::Relayed(RelayPool* owner, int size_class, int references)
+    : owner(owner)
+    , refcount(references)
+    , size_class(size_class)
+    , type(FrameType::System)
+    , sender(0)
+    , sequence(0)
+    , trace_id(0)
+    , room_size(0)
+    , text_size(0)
+{
+}
+
+const char* Relayed::Room() const
+{
+    return reinterpret_cast<const char*>(this + 1);
+}
+
+size_t Relayed::RoomSize() const
+{
+    return room_size;
+}
+
+const char* Relayed::Text() const
+{
+    return Room() + room_size;
+}
+
+size_t Relayed::TextSize() const
+{
+    return text_size;
+}
+
+FrameType Relayed::Type() const
+{
+    return type;
+}
+
+uint64_t Relayed::Sender() const
+{
+    return sender;
+}
+
+uint64_t Relayed::Sequence() const
+{
+    return sequence;
+}
+
+uint64_t Relayed::TraceId() const
+{
+    return trace_id;
+}
+
+void Relayed::Release()
+{
+    if (refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        owner->Free(this);
+    }
+}
+
+RelayPool::RelayPool()
+{
+    for (auto& free_list : free_blocks)
+    {
+        free_list = nullptr;
+    }
+}
+
+RelayPool::~RelayPool()
+{
+}
+
+size_t RelayPool::ClassSize(int size_class)
+{
+    return (size_t)256 << (2 * size_class);
+}
+
+int RelayPool::ClassFor(size_t size)
+{
+    for (int size_class = 0; size_class < CLASS_COUNT; size_class++)
+    {
+        if (size <= ClassSize(size_class))
+        {
+            return size_class;
+        }
+    }
+    return -1;
+}
+
+Relayed* RelayPool::Create(const std::string& room, const char* text, size_t len,
+                           FrameType type, uint64_t sender, uint64_t sequence, uint64_t trace_id,
+                           int references)
+{
+    size_t size = sizeof(Relayed) + room.size() + len;
+    int size_class = ClassFor(size);
+    char* block = nullptr;
+    if (size_class < 0)
+    {
+        block = new char[size];
+    }
+    else
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        FreeBlock* free_block = free_blocks[size_class];
+        if (free_block != nullptr)
+        {
+            free_blocks[size_class] = free_block->next;
+            block = reinterpret_cast<char*>(free_block);
+        }
+        else
+        {
+            blocks.emplace_back(new char[ClassSize(size_class)]);
+            block = blocks.back().get();
+        }
+    }
+
+    Relayed* relayed = new (block) Relayed(this, size_class, references);
+    relayed->type = type;
+    relayed->sender = sender;
+    relayed->sequence = sequence;
+    relayed->trace_id = trace_id;
+    relayed->room_size = room.size();
+    relayed->text_size = len;
+    char* out = reinterpret_cast<char*>(relayed + 1);
+    memcpy(out, room.data(), room.size());
+    memcpy(out + room.size(), text, len);
+    return relayed;
+}
+
+void RelayPool::Free(Relayed* relayed)
+{
+    int size_class = relayed->size_class;
+    relayed->~Relayed();
+    if (size_class < 0)
+    {
+        delete[] reinterpret_cast<char*>(relayed);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    FreeBlock* free_block = reinterpret_cast<FreeBlock*>(relayed);
+    free_block->next = free_blocks[size_class];
+    free_blocks[size_class] = free_block;
+}
@@ -0,0 +1,146 @@
+#include "rooms.h"
+#include "session.h"
+
+#include <cctype>
+
+RoomTable::RoomTable()
+{
+    rooms[LOBBY_ROOM].name = "lobby";
+    by_name[rooms[LOBBY_ROOM].name] = LOBBY_ROOM;
+
+    // hand out low ids first
+    for (int i = MAX_ROOMS - 1; i > LOBBY_ROOM; i--)
+    {
+        free_rooms.push_back(i);
+    }
+}
+
+int RoomTable::Find(const std::string& name) const
+{
+    auto it = by_name.find(name);
+    return it != by_name.end() ? it->second : -1;
+}
+
+int RoomTable::Open(const std::string& name)
+{
+    int room = Find(name);
+    if (room < 0 && !free_rooms.empty())
+    {
+        room = free_rooms.back();
+        free_rooms.pop_back();
+        rooms[room].name = name;
+        by_name[name] = room;
+    }
+    return room;
+}
+
+bool RoomTable::Join(int room, ChatSession* session)
+{
+    uint64_t bit = (uint64_t)1 << room;
+    if ((session->room_bits & bit) != 0 || session->seat_count == MAX_JOINED_ROOMS)
+    {
+        return false;
+    }
+
+    std::vector<ChatSession*>& members = rooms[room].members;
+    session->details->seats[session->seat_count++] = RoomSeat{(uint32_t)room, (uint32_t)members.size()};
+    session->room_bits |= bit;
+    members.push_back(session);
+    return true;
+}
+
+bool RoomTable::Leave(int room, ChatSession* session)
+{
+    uint64_t bit = (uint64_t)1 << room;
+    if ((session->room_bits & bit) == 0)
+    {
+        return false;
+    }
+
+    int seat = 0;
+    while (session->details->seats[seat].room != (uint32_t)room)
+    {
+        seat++;
+    }
+
+    // swap-remove from the member vector and fix the moved member's seat
+    std::vector<ChatSession*>& members = rooms[room].members;
+    uint32_t pos = session->details->seats[seat].pos;
+    ChatSession* moved = members.back();
+    members[pos] = moved;
+    for (int i = 0; i < moved->seat_count; i++)
+    {
+        if (moved->details->seats[i].room == (uint32_t)room)
+        {
+            moved->details->seats[i].pos = pos;
+        }
+    }
+    members.pop_back();
+
+    session->details->seats[seat] = session->details->seats[--session->seat_count];
+    session->room_bits &= ~bit;
+
+    if (members.empty() && room != LOBBY_ROOM)
+    {
+        by_name.erase(rooms[room].name);
+        rooms[room].name.clear();
+        rooms[room].history.Clear();
+        free_rooms.push_back(room);
+    }
+    return true;
+}
+
+void RoomTable::LeaveAll(ChatSession* session)
+{
+    while (session->seat_count > 0)
+    {
+        Leave(session->details->seats[session->seat_count - 1].room, session);
+    }
+}
+
+const std::vector<ChatSession*>& RoomTable::Members(int room) const
+{
+    return rooms[room].members;
+}
+
+void RoomTable::ReserveMembers(int room, size_t members)
+{
+    rooms[room].members.reserve(members);
+}
+
+const std::string& RoomTable::Name(int room) const
+{
+    return rooms[room].name;
+}
+
+HistoryRing& RoomTable::History(int room)
+{
+    return rooms[room].history;
+}
+
+void RoomTable::SetHistorySize(size_t messages)
+{
+    for (Room& room : rooms)
+    {
+        room.history.SetCapacity(messages);
+    }
+}
+
+bool RoomTable::Normalize(const std::string& name, std::string* room)
+{
+    if (name.empty() || name.size() > MAX_ROOM_NAME)
+    {
+        return false;
+    }
+
+    room->clear();
+    for (char c : name)
+    {
+        if (!::isalnum((unsigned char)c) && c != '-' && c != '_')
+        {
+            return false;
+        }
+        room->push_back((char)::tolower((unsigned char)c));
+    }
+    return true;
+}
@@ -0,0 +1,216 @@
+#include "session.h"
+
+#include <algorithm>
+
+// Layout guard only: the fixed part of an idle session, both halves, its
+// index entries and its lobby seat, has to fit the budget before anything
+// allocated at run time is counted. BM_IdleSessionMemory measures the rest.
+static_assert(sizeof(ChatSession) + sizeof(SessionDetails)
+              + sizeof(ChatSession*) + 2 * sizeof(uint32_t) + sizeof(ChatSession*) <= IDLE_SESSION_BUDGET,
+              "an idle session outgrew its memory budget");
+// libuv's handle alone takes four cache lines
+static_assert(sizeof(ChatSession) <= 7 * 64, "the hot half of a session outgrew its cache lines");
+
+ChatSession::ChatSession()
+    : last_activity(0)
+    , id(0)
+    , capabilities(0)
+    , inflight_bytes(0)
+    , backlog_head(nullptr)
+    , backlog_tail(nullptr)
+    , backlog_bytes(0)
+    , backlog_msgs(0)
+    , read_buf(nullptr)
+    , room_bits(0)
+    , current_room(LOBBY_ROOM)
+    , send_tokens(0)
+    , send_updated_ms(0)
+    , send_strikes(0)
+    , slot(0)
+    , generation(0)
+    , read_class(0)
+    , full_reads(0)
+    , small_reads(0)
+    , seat_count(0)
+    , protocol(WireProtocol::Unknown)
+    , disconnect_pending(false)
+    , details(nullptr)
+    , state(ReadState::NameRead)
+    , active(false)
+{
+}
+
+void ChatSession::Reset()
+{
+    // a reused slot starts without the memory its last owner grew
+    std::string().swap(details->name);
+    details->framer.Release();
+    details->framer.SetLengthPrefixed(nullptr);
+    id = 0;
+    protocol = WireProtocol::Unknown;
+    capabilities = 0;
+    state = ReadState::NameRead;
+    active = false;
+    last_activity = 0;
+    read_buf = nullptr;
+    read_class = 0;
+    full_reads = 0;
+    small_reads = 0;
+    inflight_bytes = 0;
+    backlog_head = nullptr;
+    backlog_tail = nullptr;
+    backlog_bytes = 0;
+    backlog_msgs = 0;
+    disconnect_pending = false;
+    send_tokens = 0;
+    send_updated_ms = 0;
+    send_strikes = 0;
+    room_bits = 0;
+    seat_count = 0;
+    current_room = LOBBY_ROOM;
+}
+
+ChatSession::~ChatSession()
+{
+}
+
+const std::string& ChatSession::GetName() const
+{
+    return details->name;
+}
+
+void ChatSession::SetName(FrameView frame)
+{
+    std::string& name = details->name;
+    name.assign(frame.data, frame.size);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    state = ReadState::MessageRead;
+}
+
+ChatSession::ReadState ChatSession::GetReadState() const
+{
+    return state;
+}
+
+uv_stream_t* ChatSession::GetStream()
+{
+    return (uv_stream_t*)&connection;
+}
+
+void ChatSession::Activate()
+{
+    active = true;
+}
+
+void ChatSession::Deactivate()
+{
+    active = false;
+}
+
+bool ChatSession::IsActive() const
+{
+    return active;
+}
+
+SessionTable::SessionTable()
+{
+}
+
+ChatSession* SessionTable::Acquire()
+{
+    if (free_slots.empty())
+    {
+        AddChunks(1);
+    }
+
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+
+    ChatSession* session = SlotAt(slot);
+    session->Reset();
+    live_index[slot] = live.size();
+    live.push_back(session);
+    return session;
+}
+
+void SessionTable::Release(ChatSession* session)
+{
+    // swap-remove from the dense live list
+    uint32_t pos = live_index[session->slot];
+    ChatSession* moved = live.back();
+    live[pos] = moved;
+    live_index[moved->slot] = pos;
+    live.pop_back();
+
+    session->generation++;
+    session->Reset();
+    free_slots.push_back(session->slot);
+}
+
+ChatSession* SessionTable::Find(SessionRef ref) const
+{
+    if (ref.slot >= chunks.size() * CHUNK_SIZE)
+    {
+        return nullptr;
+    }
+
+    ChatSession* session = SlotAt(ref.slot);
+    return session->generation == ref.generation ? session : nullptr;
+}
+
+SessionRef SessionTable::MakeRef(const ChatSession* session) const
+{
+    return SessionRef{session->slot, session->generation};
+}
+
+const std::vector<ChatSession*>& SessionTable::Live() const
+{
+    return live;
+}
+
+size_t SessionTable::Size() const
+{
+    return live.size();
+}
+
+void SessionTable::Reserve(size_t sessions)
+{
+    size_t capacity = chunks.size() * CHUNK_SIZE;
+    if (sessions > capacity)
+    {
+        AddChunks((sessions - capacity + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+    live.reserve(sessions);
+}
+
+void SessionTable::AddChunks(size_t count)
+{
+    uint32_t first = chunks.size() * CHUNK_SIZE;
+    for (size_t i = 0; i < count; i++)
+    {
+        chunks.emplace_back(new ChatSession[CHUNK_SIZE]);
+        detail_chunks.emplace_back(new SessionDetails[CHUNK_SIZE]);
+    }
+    uint32_t end = chunks.size() * CHUNK_SIZE;
+    live_index.resize(end);
+
+    // hand out low slots first: new ones go below the free slots left
+    std::vector<uint32_t> slots;
+    slots.reserve(end - first + free_slots.size());
+    for (uint32_t slot = end; slot > first; slot--)
+    {
+        ChatSession* session = SlotAt(slot - 1);
+        session->slot = slot - 1;
+        session->details = &detail_chunks[(slot - 1) / CHUNK_SIZE][(slot - 1) % CHUNK_SIZE];
+        // legacy text is relayed to v2 members too, as a single frame
+        session->details->framer.SetMaxFrame(MAX_FRAME_PAYLOAD);
+        slots.push_back(slot - 1);
+    }
+    slots.insert(slots.end(), free_slots.begin(), free_slots.end());
+    free_slots.swap(slots);
+}
+
+ChatSession* SessionTable::SlotAt(uint32_t slot) const
+{
+    return &chunks[slot / CHUNK_SIZE][slot % CHUNK_SIZE];
+}
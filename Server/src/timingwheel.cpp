@@ -0,0 +1,143 @@
+#include "timingwheel.h"
+
+static void Unlink(WheelNode* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+}
+
+WheelNode::WheelNode()
+    : prev(nullptr)
+    , next(nullptr)
+    , expiry(0)
+    , data(nullptr)
+{
+}
+
+bool WheelNode::IsScheduled() const
+{
+    return next != nullptr;
+}
+
+TimingWheel::TimingWheel()
+    : current_tick(0)
+{
+    for (int level = 0; level < LEVELS; level++)
+    {
+        for (int slot = 0; slot < SLOTS; slot++)
+        {
+            WheelNode* head = &buckets[level][slot];
+            head->prev = head;
+            head->next = head;
+        }
+    }
+}
+
+void TimingWheel::Start(uint64_t now_tick)
+{
+    current_tick = now_tick;
+}
+
+void TimingWheel::Schedule(WheelNode* node, uint64_t expiry_tick)
+{
+    if (node->IsScheduled())
+    {
+        Unlink(node);
+    }
+
+    // a deadline in the past fires on the next tick
+    node->expiry = expiry_tick > current_tick ? expiry_tick : current_tick + 1;
+    Insert(node);
+}
+
+void TimingWheel::Cancel(WheelNode* node)
+{
+    if (node->IsScheduled())
+    {
+        Unlink(node);
+    }
+}
+
+void TimingWheel::Insert(WheelNode* node)
+{
+    // pick the lowest level whose span still reaches the deadline
+    int level = 0;
+    uint64_t slot = 0;
+    for (; level < LEVELS; level++)
+    {
+        int shift = level * SLOT_BITS;
+        if ((node->expiry >> shift) - (current_tick >> shift) < (uint64_t)SLOTS)
+        {
+            slot = (node->expiry >> shift) & (SLOTS - 1);
+            break;
+        }
+    }
+
+    if (level == LEVELS)
+    {
+        // beyond the top level: park in its furthest bucket, the node is
+        // reinserted from there when that bucket cascades
+        level = LEVELS - 1;
+        int shift = level * SLOT_BITS;
+        slot = ((current_tick >> shift) + SLOTS - 1) & (SLOTS - 1);
+    }
+
+    WheelNode* head = &buckets[level][slot];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void TimingWheel::Cascade()
+{
+    for (int level = 1; level < LEVELS; level++)
+    {
+        int shift = level * SLOT_BITS;
+        WheelNode* head = &buckets[level][(current_tick >> shift) & (SLOTS - 1)];
+
+        // detach the whole bucket first, Insert may put nodes back on this level
+        WheelNode* node = head->next;
+        head->prev->next = nullptr;
+        head->prev = head;
+        head->next = head;
+        while (node != nullptr && node != head)
+        {
+            WheelNode* next = node->next;
+            Insert(node);
+            node = next;
+        }
+
+        if (((current_tick >> shift) & (SLOTS - 1)) != 0)
+        {
+            break;
+        }
+    }
+}
+
+void TimingWheel::Advance(uint64_t now_tick, std::vector<WheelNode*>& expired)
+{
+    while (current_tick < now_tick)
+    {
+        current_tick++;
+        if ((current_tick & (SLOTS - 1)) == 0)
+        {
+            Cascade();
+        }
+
+        WheelNode* head = &buckets[0][current_tick & (SLOTS - 1)];
+        while (head->next != head)
+        {
+            WheelNode* node = head->next;
+            Unlink(node);
+            expired.push_back(node);
+        }
+    }
+}
+
+uint64_t TimingWheel::CurrentTick() const
+{
+    return current_tick;
+}
@@ -0,0 +1,217 @@
+#include "tracing.h"
+
+#include <algorithm>
+#include <cstdio>
+
+struct TraceEvent
+{
+    uint64_t timestamp;
+    uint64_t id;
+    TracePoint point;
+    uint32_t arg;
+    uint32_t thread;
+};
+
+TraceOptions::TraceOptions()
+    : sample_every(0)
+    , ring_events(64 * 1024)
+    , path("chat-trace.json")
+{
+}
+
+TraceRing::TraceRing(uint32_t thread, uint32_t sample_every, size_t capacity)
+    : thread(thread)
+    , sample_every(sample_every)
+    , countdown(sample_every)
+    , sampled(0)
+    , head(0)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size *= 2;
+    }
+    mask = size - 1;
+    slots.reset(new Slot[size]);
+}
+
+Tracer* Tracer::GetInstance()
+{
+    static Tracer tracer;
+    return &tracer;
+}
+
+Tracer::Tracer()
+{
+}
+
+void Tracer::Configure(const TraceOptions& options)
+{
+    this->options = options;
+}
+
+bool Tracer::IsEnabled() const
+{
+    return options.sample_every != 0;
+}
+
+TraceRing* Tracer::Register(uint32_t thread)
+{
+    if (!IsEnabled())
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(rings_lock);
+    rings.emplace_back(new TraceRing(thread, options.sample_every, options.ring_events));
+    return rings.back().get();
+}
+
+static void AppendEvent(std::string* out, const char* phase, const char* name,
+                        const TraceEvent& at, uint64_t timestamp, const char* args)
+{
+    char line[256];
+    snprintf(line, sizeof(line),
+             ",\n{\"ph\":\"%s\",\"cat\":\"msg\",\"name\":\"%s\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%.3f%s%s}",
+             phase, name, (unsigned long long)at.id, at.thread,
+             timestamp / 1000.0, args[0] != 0 ? ",\"args\":" : "", args);
+    out->append(line);
+}
+
+static void AppendSpan(std::string* out, const char* name, const TraceEvent& at,
+                       uint64_t begin, uint64_t end, const char* args = "")
+{
+    AppendEvent(out, "b", name, at, begin, args);
+    AppendEvent(out, "e", name, at, std::max(begin, end), "");
+}
+
+void Tracer::Render(std::string* out)
+{
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> guard(rings_lock);
+        for (auto& ring : rings)
+        {
+            uint64_t capacity = ring->mask + 1;
+            uint64_t end = ring->head.load(std::memory_order_acquire);
+            uint64_t begin = end > capacity ? end - capacity : 0;
+            size_t first = events.size();
+            for (uint64_t pos = begin; pos < end; pos++)
+            {
+                TraceRing::Slot& slot = ring->slots[pos & ring->mask];
+                uint64_t info = slot.info.load(std::memory_order_relaxed);
+                TraceEvent event;
+                event.timestamp = slot.timestamp.load(std::memory_order_relaxed);
+                event.id = slot.id.load(std::memory_order_relaxed);
+                event.point = (TracePoint)(info & 0xFF);
+                event.arg = (uint32_t)(info >> 8);
+                event.thread = ring->thread;
+                events.push_back(event);
+            }
+
+            // the writer kept going: slots it reached meanwhile may be torn
+            uint64_t now = ring->head.load(std::memory_order_acquire);
+            if (now + 1 > begin + capacity)
+            {
+                size_t stale = std::min<uint64_t>(now + 1 - capacity - begin, end - begin);
+                events.erase(events.begin() + first, events.begin() + first + stale);
+            }
+        }
+    }
+
+    std::sort(events.begin(), events.end(),
+              [] (const TraceEvent& a, const TraceEvent& b)
+              {
+                  return a.id != b.id ? a.id < b.id : a.timestamp < b.timestamp;
+              });
+
+    // one async track per message: parse, then per shard the fan-out and
+    // the writes until the last recipient's completed
+    out->append("{\"traceEvents\":[");
+    // every event starts with a separator, the first one's is blanked
+    size_t first_event = out->size();
+    size_t pos = 0;
+    while (pos < events.size())
+    {
+        size_t end = pos;
+        const TraceEvent* read = nullptr;
+        const TraceEvent* frame = nullptr;
+        while (end < events.size() && events[end].id == events[pos].id)
+        {
+            if (events[end].point == TracePoint::Read)
+            {
+                read = &events[end];
+            }
+            else if (events[end].point == TracePoint::Frame)
+            {
+                frame = &events[end];
+            }
+            end++;
+        }
+
+        // the start has been overwritten, the rest can't be placed
+        if (read == nullptr || frame == nullptr)
+        {
+            pos = end;
+            continue;
+        }
+
+        uint64_t last = frame->timestamp;
+        for (size_t i = pos; i < end; i++)
+        {
+            last = std::max(last, events[i].timestamp);
+        }
+        AppendEvent(out, "b", "message", *frame, read->timestamp, "");
+        AppendSpan(out, "parse", *frame, read->timestamp, frame->timestamp);
+
+        for (size_t i = pos; i < end; i++)
+        {
+            const TraceEvent& broadcast = events[i];
+            if (broadcast.point != TracePoint::Broadcast)
+            {
+                continue;
+            }
+
+            uint64_t written = broadcast.timestamp;
+            uint32_t completed = 0;
+            uint32_t failed = 0;
+            for (size_t j = pos; j < end; j++)
+            {
+                if (events[j].point == TracePoint::WriteDone && events[j].thread == broadcast.thread)
+                {
+                    written = std::max(written, events[j].timestamp);
+                    completed++;
+                    failed += events[j].arg;
+                }
+            }
+
+            char args[128];
+            snprintf(args, sizeof(args), "{\"recipients\":%u}", broadcast.arg);
+            AppendSpan(out, "fanout", broadcast, frame->timestamp, broadcast.timestamp, args);
+            snprintf(args, sizeof(args), "{\"completed\":%u,\"failed\":%u}", completed, failed);
+            AppendSpan(out, "writes", broadcast, broadcast.timestamp, written, args);
+        }
+
+        AppendEvent(out, "e", "message", *frame, last, "");
+        pos = end;
+    }
+    if (out->size() > first_event)
+    {
+        (*out)[first_event] = ' ';
+    }
+    out->append("\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+bool Tracer::WriteFile()
+{
+    std::string json;
+    Render(&json);
+
+    FILE* file = fopen(options.path.c_str(), "w");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+    return fclose(file) == 0 && written;
+}
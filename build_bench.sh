@@ -0,0 +1,5 @@
+rm -rf Build_Bench
+mkdir Build_Bench
+cd Build_Bench
+cmake ../Bench -DCMAKE_BUILD_TYPE=$1
+make